@@ -1,13 +1,49 @@
-#include <boost/function_output_iterator.hpp>
 #include <boost/geometry/geometry.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <linux/perf_event.h>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
 #include <random>
+#include <string>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
+#ifdef DLAF_MPI
+#include <mpi.h>
+#endif
+
 // number of dimensions (must be 2 or 3)
 const int D = 2;
 
+// fixed-point mode: when non-zero, particles and index keys are stored on an
+// integer grid with this many units per unit of distance (e.g. 1024), join
+// tests compare integer squared distances and walkers are snapped to the grid
+// after every move. Built with -ffp-contract=off (make REPRODUCIBLE=1) this
+// makes runs with the same seed bit-exact across machines, -march settings
+// and standard libraries.
+// Coordinates must stay within +/- 2^31 units.
+const int FixedPointScale = 0;
+
+// size of one fixed-point grid unit (unused when fixed-point mode is off)
+const double FixedPointUnit = 1.0 / (FixedPointScale ? FixedPointScale : 1);
+
 // default parameters (documented below)
 const double DefaultParticleSpacing = 1;
 const double DefaultAttractionDistance = 3;
@@ -15,14 +51,746 @@ const double DefaultMinMoveDistance = 1;
 const int DefaultStubbornness = 0;
 const double DefaultStickiness = 1;
 
-// boost is used for its spatial index
+// dielectric breakdown mode: after each growth step the potential is only
+// relaxed with DBMWindowSweeps Gauss-Seidel sweeps over the cells within
+// DBMWindowRadius of the new cells. Every DBMFullSolveInterval steps it is
+// solved over the whole grid with multigrid V-cycles until the largest
+// residual of the discrete Laplace equation is below DBMTolerance (or
+// DBMMaxCycles were run), which removes the error the local updates leave
+// far from the new cells. Each level is smoothed with DBMSmoothIterations
+// Gauss-Seidel sweeps before and after the coarser levels, down to a grid of
+// DBMCoarsestSize cells per axis.
+const int DBMWindowRadius = 6;
+const int DBMWindowSweeps = 6;
+const int DBMFullSolveInterval = 16;
+const double DBMTolerance = 1e-5;
+const int DBMMaxCycles = 32;
+const int DBMSmoothIterations = 2;
+const int DBMCoarsestSize = 8;
+
+// Eden mode: number of random directions tried around a particle before it
+// is considered enclosed, and the fraction of ParticleSpacing that other
+// particles must keep clear of a new particle (slightly below 1 so that the
+// parent itself does not count as an overlap)
+const int EdenAttempts = 16;
+const double EdenClearance = 0.999;
+
+// ParticleLog chunk size and maximum number of chunks (the capacity of a
+// log is their product)
+const int ParticleLogChunkSize = 1 << 16;
+const int ParticleLogMaxChunks = 1 << 14;
+
+// default quantization step for delta-encoded output
+const double DefaultOutputPrecision = 1e-3;
+
+// number of particles per block in delta-encoded output
+const int DeltaBlockSize = 4096;
+
+// size of the first block requested by an Arena that has not been reserved
+const size_t DefaultArenaBlockSize = 1 << 20;
+
+// the frontier tier of the spatial index holds recently added particles. It
+// is frozen into the static tier once it holds more than FrontierMinSize
+// particles and more than 1 / FrontierFraction of all particles.
+const int FrontierMinSize = 1 << 12;
+const int FrontierFraction = 4;
+
+// walkers publish their walk steps to the model's counters every this many
+// steps (and when they join), so that progress shows even while a walker
+// takes very long to join
+const uint64_t WalkStepsPublishInterval = 1 << 16;
+
+// PerfCounters measure one in this many particles, as reading the counters
+// takes time (and a system call where they cannot be read with rdpmc)
+const int PerfSampleInterval = 256;
+
+// number of walkers interleaved on one thread by Model::AddParticles
+const int DefaultInterleavedWalkers = 8;
+
+// distributed mode (built with -DDLAF_MPI): width of the halo of particles
+// each rank copies from its neighbors, walkers per rank, and walk steps per
+// walker between exchanges
+const double DefaultHaloWidth = 12;
+const int DefaultDistributedWalkers = 16;
+const int DefaultStepsPerRound = 256;
+
+// distributed mode: the cluster grows by at most this fraction per round
+const double MaxRoundGrowth = 0.25;
+
+// distributed mode: MPI counts and displacements are int, so collectives
+// move at most this many bytes per call and larger transfers take several
+const uint64_t MPIChunkBytes = 1 << 30;
+
+// Arena is a monotonic allocator. Memory is handed out by bumping a pointer
+// through large blocks and is only returned to the system when the arena is
+// destroyed (or reused after Reset), so the many small allocations made by
+// the spatial index cost a few instructions each. When disabled, every
+// request is forwarded to operator new, which is useful for comparing
+// allocation counts.
+class Arena {
+public:
+    Arena() :
+        m_Enabled(true),
+        m_HugePages(false),
+        m_NextBlockSize(DefaultArenaBlockSize),
+        m_Ptr(nullptr),
+        m_End(nullptr),
+        m_Allocations(0),
+        m_SystemAllocations(0),
+        m_BytesAllocated(0) {}
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+        for (const auto &block : m_Blocks) {
+            munmap(block.first, block.second);
+        }
+    }
+
+    // SetEnabled switches between the arena and operator new. Memory from
+    // one cannot be returned to the other, so it throws once anything has
+    // been allocated.
+    void SetEnabled(const bool enabled) {
+        if (enabled != m_Enabled && m_Allocations > 0) {
+            throw std::logic_error(
+                "Arena::SetEnabled called after allocations were made");
+        }
+        m_Enabled = enabled;
+    }
+
+    // SetHugePages requests that future blocks be backed by huge pages. If
+    // no huge pages are available, transparent huge pages are requested
+    // instead.
+    void SetHugePages(const bool hugePages) {
+        m_HugePages = hugePages;
+    }
+
+    // Reserve makes sure that at least the specified number of bytes can be
+    // allocated without requesting another block from the system
+    void Reserve(const size_t bytes) {
+        if (!m_Enabled || (size_t)(m_End - m_Ptr) >= bytes) {
+            return;
+        }
+        NewBlock(bytes);
+    }
+
+    void *Allocate(const size_t size, const size_t align) {
+        m_Allocations++;
+        m_BytesAllocated += size;
+        if (!m_Enabled) {
+            m_SystemAllocations++;
+            return ::operator new(size);
+        }
+        char *p = AlignUp(m_Ptr, align);
+        if (p == nullptr || p + size > m_End) {
+            NewBlock(std::max(m_NextBlockSize, size + align));
+            p = AlignUp(m_Ptr, align);
+        }
+        m_Ptr = p + size;
+        return p;
+    }
+
+    void Deallocate(void *p) {
+        if (!m_Enabled) {
+            ::operator delete(p);
+        }
+    }
+
+    // Reset makes the arena's memory available again, continuing from the
+    // start of its largest block. It must only be called when nothing
+    // allocated from the arena is in use anymore.
+    void Reset() {
+        if (!m_Enabled || m_Blocks.empty()) {
+            return;
+        }
+        m_Ptr = (char *)m_Blocks.back().first;
+        m_End = m_Ptr + m_Blocks.back().second;
+        m_BytesAllocated = 0;
+    }
+
+    // Allocations returns the number of allocation requests served
+    size_t Allocations() const {
+        return m_Allocations;
+    }
+
+    // SystemAllocations returns the number of times memory was requested
+    // from the system (blocks, or individual requests when disabled)
+    size_t SystemAllocations() const {
+        return m_SystemAllocations;
+    }
+
+    // BytesAllocated returns the number of bytes handed out since the arena
+    // was created or last reset
+    size_t BytesAllocated() const {
+        return m_BytesAllocated;
+    }
+
+private:
+    static char *AlignUp(char *p, const size_t align) {
+        const uintptr_t a = (uintptr_t)p;
+        return (char *)((a + align - 1) & ~(uintptr_t)(align - 1));
+    }
+
+    void NewBlock(const size_t minSize) {
+        const size_t pageSize = m_HugePages ? (2 << 20) : 4096;
+        const size_t size = (minSize + pageSize - 1) / pageSize * pageSize;
+        void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (m_HugePages) {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        if (p == MAP_FAILED) {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+#ifdef MADV_HUGEPAGE
+            if (m_HugePages) {
+                madvise(p, size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        m_Blocks.emplace_back(p, size);
+        m_SystemAllocations++;
+        m_Ptr = (char *)p;
+        m_End = m_Ptr + size;
+        m_NextBlockSize = std::max(m_NextBlockSize, size) * 2;
+    }
+
+    bool m_Enabled;
+    bool m_HugePages;
+    size_t m_NextBlockSize;
+    char *m_Ptr;
+    char *m_End;
+    size_t m_Allocations;
+    size_t m_SystemAllocations;
+    size_t m_BytesAllocated;
+    std::vector<std::pair<void *, size_t>> m_Blocks;
+};
+
+// ArenaAllocator adapts an Arena to the standard allocator interface
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena *arena) :
+        m_Arena(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) :
+        m_Arena(other.GetArena()) {}
+
+    T *allocate(const size_t n) {
+        return (T *)m_Arena->Allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T *p, const size_t n) {
+        m_Arena->Deallocate(p);
+    }
+
+    Arena *GetArena() const {
+        return m_Arena;
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const {
+        return m_Arena == other.GetArena();
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const {
+        return m_Arena != other.GetArena();
+    }
+
+private:
+    Arena *m_Arena;
+};
+
+// Coordinate is the type of the index keys
+using Coordinate = std::conditional<
+    FixedPointScale != 0, int32_t, double>::type;
+
+// ToCoordinate converts a distance to an index key coordinate
+Coordinate ToCoordinate(const double x) {
+    if (FixedPointScale != 0) {
+        return std::llround(x * FixedPointScale);
+    }
+    return x;
+}
+
+// index keys are boost geometry points
 using BoostPoint = boost::geometry::model::point<
-    double, D, boost::geometry::cs::cartesian>;
+    Coordinate, D, boost::geometry::cs::cartesian>;
+
+// DistanceSquared is the type of squared distances between index keys
+using DistanceSquared = std::conditional<
+    FixedPointScale != 0, int64_t, double>::type;
+
+// KeyDistanceSquared returns the squared distance between two index keys, in
+// squared fixed-point units when fixed-point mode is enabled
+template <std::size_t I = 0>
+typename std::enable_if<I == D, DistanceSquared>::type
+KeyDistanceSquared(const BoostPoint &a, const BoostPoint &b) {
+    return 0;
+}
+
+template <std::size_t I = 0>
+typename std::enable_if<I < D, DistanceSquared>::type
+KeyDistanceSquared(const BoostPoint &a, const BoostPoint &b) {
+    const DistanceSquared d =
+        (DistanceSquared)boost::geometry::get<I>(a) -
+        boost::geometry::get<I>(b);
+    return d * d + KeyDistanceSquared<I + 1>(a, b);
+}
+
+// Key holds the coordinates of an index key in a plain array
+using Key = std::array<Coordinate, D>;
+
+// ToKey copies the coordinates of an index key into an array
+Key ToKey(const BoostPoint &p) {
+    Key key;
+    key[0] = boost::geometry::get<0>(p);
+    key[1] = boost::geometry::get<1>(p);
+    key[D - 1] = boost::geometry::get<D - 1>(p);
+    return key;
+}
+
+// KeyTree is a bounding volume hierarchy over index keys, used for both tiers
+// of the spatial index. It can be bulk loaded, splitting the keys at the
+// median of the longest axis all the way down, or grown one key at a time,
+// splitting a leaf at its median once it is full. A growing cluster inserts
+// keys in a very skewed order, so the tree is bulk loaded again in place when
+// an insert goes too deep. The two children of a node are stored next to each
+// other and the keys of a leaf are stored together. All storage comes from an
+// arena.
+class KeyTree {
+public:
+    // traversals keep at most one pending node per level
+    static const int StackSize = 64;
+
+    // Search holds the state of a nearest key search that is advanced one
+    // node at a time, so that the searches of several walkers can be
+    // interleaved. Each node is prefetched when it is pushed, and is loaded
+    // by the time the search gets back to it.
+    struct Search {
+        Key Target;
+        int Result;
+        DistanceSquared Distance;
+        int Generation;
+        int Count;
+        std::pair<int, DistanceSquared> Stack[StackSize];
+    };
+
+    explicit KeyTree(Arena *arena) :
+        m_Nodes(ArenaAllocator<Node>(arena)),
+        m_Keys(ArenaAllocator<Key>(arena)),
+        m_Ids(ArenaAllocator<int>(arena)),
+        m_Size(0),
+        m_Generation(0) {}
+
+    // Reserve allocates storage for the specified number of keys
+    void Reserve(const size_t n) {
+        const size_t leaves = n / (LeafSize / 2) + 1;
+        m_Nodes.reserve(leaves * 2);
+        m_Keys.reserve(leaves * LeafSize);
+        m_Ids.reserve(leaves * LeafSize);
+    }
+
+    // Clear removes all keys and gives the storage back to the arena
+    void Clear() {
+        const ArenaAllocator<Node> allocator = m_Nodes.get_allocator();
+        decltype(m_Nodes)(allocator).swap(m_Nodes);
+        decltype(m_Keys)(allocator).swap(m_Keys);
+        decltype(m_Ids)(allocator).swap(m_Ids);
+        m_Size = 0;
+        m_Generation++;
+    }
+
+    size_t Size() const {
+        return m_Size;
+    }
+
+    // Build replaces the contents of the tree with the specified keys,
+    // reusing its storage
+    void Build(std::vector<std::pair<Key, int>> values) {
+        m_Nodes.clear();
+        m_Keys.clear();
+        m_Ids.clear();
+        m_Size = 0;
+        m_Generation++;
+        if (values.empty()) {
+            return;
+        }
+        Reserve(values.size());
+        m_Nodes.emplace_back();
+        Build(values, 0, 0, values.size());
+        m_Size = values.size();
+    }
+
+    // Insert adds a key, descending into the child whose bounds are nearest
+    void Insert(const Key &key, const int id) {
+        if (m_Nodes.empty()) {
+            m_Nodes.push_back(Node{key, key, NewBucket(), 0});
+        }
+        int i = 0;
+        int depth = 0;
+        while (true) {
+            Node &node = m_Nodes[i];
+            for (int k = 0; k < D; k++) {
+                node.Lo[k] = std::min(node.Lo[k], key[k]);
+                node.Hi[k] = std::max(node.Hi[k], key[k]);
+            }
+            if (node.Count < 0) {
+                const int left = node.Index;
+                i = BoxDistanceSquared(m_Nodes[left], key) <=
+                    BoxDistanceSquared(m_Nodes[left + 1], key) ?
+                    left : left + 1;
+                depth++;
+                continue;
+            }
+            if (node.Count < LeafSize) {
+                m_Keys[node.Index + node.Count] = key;
+                m_Ids[node.Index + node.Count] = id;
+                node.Count++;
+                m_Size++;
+                break;
+            }
+            Split(i);
+        }
+        if (depth > MaxDepth(m_Size)) {
+            Rebuild();
+        }
+    }
+
+    // Nearest returns the id of the key nearest the specified key if it is
+    // closer than distanceSquared, updating distanceSquared, and returns
+    // result otherwise
+    int Nearest(
+        const Key &key, int result, DistanceSquared &distanceSquared) const
+    {
+        if (m_Nodes.empty()) {
+            return result;
+        }
+        std::pair<int, DistanceSquared> stack[StackSize];
+        int n = 0;
+        stack[n++] = std::make_pair(0, BoxDistanceSquared(m_Nodes[0], key));
+        while (n > 0) {
+            const int i = stack[--n].first;
+            if (stack[n].second >= distanceSquared) {
+                continue;
+            }
+            const Node &node = m_Nodes[i];
+            if (node.Count >= 0) {
+                for (int j = node.Index; j < node.Index + node.Count; j++) {
+                    const DistanceSquared d2 = KeyDistance(m_Keys[j], key);
+                    if (d2 < distanceSquared) {
+                        distanceSquared = d2;
+                        result = m_Ids[j];
+                    }
+                }
+                continue;
+            }
+            // visit the nearer child first
+            const int left = node.Index;
+            const DistanceSquared dl = BoxDistanceSquared(m_Nodes[left], key);
+            const DistanceSquared dr =
+                BoxDistanceSquared(m_Nodes[left + 1], key);
+            if (dl < dr) {
+                stack[n++] = std::make_pair(left + 1, dr);
+                stack[n++] = std::make_pair(left, dl);
+            } else {
+                stack[n++] = std::make_pair(left, dl);
+                stack[n++] = std::make_pair(left + 1, dr);
+            }
+        }
+        return result;
+    }
+
+    // Start begins an interleaved search for the key nearest the specified
+    // key that is closer than distanceSquared, with result as the answer if
+    // none is
+    void Start(
+        Search &search, const Key &key, const int result,
+        const DistanceSquared distanceSquared) const
+    {
+        search.Target = key;
+        search.Result = result;
+        search.Distance = distanceSquared;
+        search.Generation = m_Generation;
+        search.Count = 0;
+        if (!m_Nodes.empty()) {
+            Push(search, 0, BoxDistanceSquared(m_Nodes[0], key));
+        }
+    }
+
+    // Valid returns false if the tree was rebuilt since the search started,
+    // in which case it must be started again
+    bool Valid(const Search &search) const {
+        return search.Generation == m_Generation;
+    }
+
+    // Advance visits the next node of a search, and returns false once the
+    // search is complete
+    bool Advance(Search &search) const {
+        if (search.Count == 0) {
+            return false;
+        }
+        const auto &top = search.Stack[--search.Count];
+        if (top.second >= search.Distance) {
+            return search.Count > 0;
+        }
+        const Node &node = m_Nodes[top.first];
+        if (node.Count >= 0) {
+            for (int j = node.Index; j < node.Index + node.Count; j++) {
+                const DistanceSquared d2 =
+                    KeyDistance(m_Keys[j], search.Target);
+                if (d2 < search.Distance) {
+                    search.Distance = d2;
+                    search.Result = m_Ids[j];
+                }
+            }
+            return search.Count > 0;
+        }
+        const int left = node.Index;
+        const DistanceSquared dl =
+            BoxDistanceSquared(m_Nodes[left], search.Target);
+        const DistanceSquared dr =
+            BoxDistanceSquared(m_Nodes[left + 1], search.Target);
+        if (dl < dr) {
+            Push(search, left + 1, dr);
+            Push(search, left, dl);
+        } else {
+            Push(search, left, dl);
+            Push(search, left + 1, dr);
+        }
+        return search.Count > 0;
+    }
+
+    // Query calls f with the id of every key inside the box from lo to hi
+    template <typename F>
+    void Query(const Key &lo, const Key &hi, F f) const {
+        if (m_Nodes.empty()) {
+            return;
+        }
+        int stack[StackSize];
+        int n = 0;
+        stack[n++] = 0;
+        while (n > 0) {
+            const Node &node = m_Nodes[stack[--n]];
+            bool overlaps = true;
+            for (int k = 0; k < D; k++) {
+                overlaps &= node.Lo[k] <= hi[k] && node.Hi[k] >= lo[k];
+            }
+            if (!overlaps) {
+                continue;
+            }
+            if (node.Count < 0) {
+                stack[n++] = node.Index + 1;
+                stack[n++] = node.Index;
+                continue;
+            }
+            for (int j = node.Index; j < node.Index + node.Count; j++) {
+                bool inside = true;
+                for (int k = 0; k < D; k++) {
+                    inside &= m_Keys[j][k] >= lo[k] && m_Keys[j][k] <= hi[k];
+                }
+                if (inside) {
+                    f(m_Ids[j]);
+                }
+            }
+        }
+    }
+
+private:
+    static const int LeafSize = 8;
+
+    // MaxDepth returns the depth beyond which a tree of the specified size
+    // is rebuilt, about twice the depth of a balanced tree
+    static int MaxDepth(const size_t size) {
+        int depth = 0;
+        while (((size_t)LeafSize << depth) < size) {
+            depth++;
+        }
+        return std::min(depth * 2 + 8, StackSize - 2);
+    }
+
+    struct Node {
+        Key Lo;
+        Key Hi;
+        int Index; // first key for leaves, left child for inner nodes
+        int Count; // number of keys for leaves, -1 for inner nodes
+    };
+
+    // summed in the same order as KeyDistanceSquared so that the results
+    // are identical
+    static DistanceSquared KeyDistance(const Key &a, const Key &b) {
+        DistanceSquared result = 0;
+        for (int k = D - 1; k >= 0; k--) {
+            const DistanceSquared d = (DistanceSquared)a[k] - b[k];
+            result = d * d + result;
+        }
+        return result;
+    }
+
+    static DistanceSquared BoxDistanceSquared(const Node &node, const Key &p) {
+        DistanceSquared result = 0;
+        for (int k = 0; k < D; k++) {
+            DistanceSquared d = 0;
+            if (p[k] < node.Lo[k]) {
+                d = (DistanceSquared)node.Lo[k] - p[k];
+            } else if (p[k] > node.Hi[k]) {
+                d = (DistanceSquared)p[k] - node.Hi[k];
+            }
+            result += d * d;
+        }
+        return result;
+    }
+
+    static int LongestAxis(const Key &lo, const Key &hi) {
+        int axis = 0;
+        for (int k = 1; k < D; k++) {
+            if (hi[k] - lo[k] > hi[axis] - lo[axis]) {
+                axis = k;
+            }
+        }
+        return axis;
+    }
+
+    // Push adds a node to a search unless it is out of range, and prefetches
+    // what the search will read when it visits the node
+    void Push(Search &search, const int i, const DistanceSquared d2) const {
+        if (d2 >= search.Distance) {
+            return;
+        }
+        search.Stack[search.Count++] = std::make_pair(i, d2);
+        const Node &node = m_Nodes[i];
+        if (node.Count < 0) {
+            __builtin_prefetch(&m_Nodes[node.Index]);
+            __builtin_prefetch(&m_Nodes[node.Index + 1]);
+        } else {
+            __builtin_prefetch(&m_Keys[node.Index]);
+            __builtin_prefetch(&m_Keys[node.Index + LeafSize - 1]);
+            __builtin_prefetch(&m_Ids[node.Index]);
+        }
+    }
+
+    // Rebuild bulk loads the tree again from its own keys
+    void Rebuild() {
+        std::vector<std::pair<Key, int>> values;
+        values.reserve(m_Size);
+        for (const Node &node : m_Nodes) {
+            for (int j = node.Index; j < node.Index + node.Count; j++) {
+                values.emplace_back(m_Keys[j], m_Ids[j]);
+            }
+        }
+        Build(std::move(values));
+    }
+
+    // NewBucket returns the first slot of storage for a new leaf
+    int NewBucket() {
+        const int bucket = m_Keys.size();
+        m_Keys.resize(bucket + LeafSize);
+        m_Ids.resize(bucket + LeafSize);
+        return bucket;
+    }
+
+    // Build makes node i the root of the subtree holding values from begin
+    // to end, splitting them at the median of the longest axis
+    void Build(
+        std::vector<std::pair<Key, int>> &values,
+        const int i, const int begin, const int end)
+    {
+        Key lo = values[begin].first;
+        Key hi = lo;
+        for (int j = begin + 1; j < end; j++) {
+            for (int k = 0; k < D; k++) {
+                lo[k] = std::min(lo[k], values[j].first[k]);
+                hi[k] = std::max(hi[k], values[j].first[k]);
+            }
+        }
+        m_Nodes[i].Lo = lo;
+        m_Nodes[i].Hi = hi;
+        if (end - begin <= LeafSize) {
+            const int bucket = NewBucket();
+            for (int j = begin; j < end; j++) {
+                m_Keys[bucket + j - begin] = values[j].first;
+                m_Ids[bucket + j - begin] = values[j].second;
+            }
+            m_Nodes[i].Index = bucket;
+            m_Nodes[i].Count = end - begin;
+            return;
+        }
+        const int axis = LongestAxis(lo, hi);
+        const int mid = begin + (end - begin) / 2;
+        std::nth_element(
+            values.begin() + begin, values.begin() + mid,
+            values.begin() + end,
+            [axis](const std::pair<Key, int> &a, const std::pair<Key, int> &b) {
+                return a.first[axis] < b.first[axis];
+            });
+        const int left = m_Nodes.size();
+        m_Nodes.resize(left + 2);
+        m_Nodes[i].Index = left;
+        m_Nodes[i].Count = -1;
+        Build(values, left, begin, mid);
+        Build(values, left + 1, mid, end);
+    }
+
+    // Split turns the full leaf i into an inner node with two leaves, keeping
+    // the lower half of its keys in its own bucket
+    void Split(const int i) {
+        const int bucket = m_Nodes[i].Index;
+        const int axis = LongestAxis(m_Nodes[i].Lo, m_Nodes[i].Hi);
+        std::array<std::pair<Key, int>, LeafSize> values;
+        for (int j = 0; j < LeafSize; j++) {
+            values[j] = std::make_pair(m_Keys[bucket + j], m_Ids[bucket + j]);
+        }
+        std::sort(values.begin(), values.end(),
+            [axis](const std::pair<Key, int> &a, const std::pair<Key, int> &b) {
+                return a.first[axis] < b.first[axis];
+            });
+        const int left = m_Nodes.size();
+        const int other = NewBucket();
+        m_Nodes.resize(left + 2);
+        m_Nodes[left].Index = bucket;
+        m_Nodes[left + 1].Index = other;
+        for (int c = 0; c < 2; c++) {
+            Node &child = m_Nodes[left + c];
+            child.Count = LeafSize / 2;
+            child.Lo = child.Hi = values[c * LeafSize / 2].first;
+            for (int j = 0; j < LeafSize / 2; j++) {
+                const auto &value = values[c * LeafSize / 2 + j];
+                m_Keys[child.Index + j] = value.first;
+                m_Ids[child.Index + j] = value.second;
+                for (int k = 0; k < D; k++) {
+                    child.Lo[k] = std::min(child.Lo[k], value.first[k]);
+                    child.Hi[k] = std::max(child.Hi[k], value.first[k]);
+                }
+            }
+        }
+        m_Nodes[i].Index = left;
+        m_Nodes[i].Count = -1;
+    }
+
+    std::vector<Node, ArenaAllocator<Node>> m_Nodes;
+    std::vector<Key, ArenaAllocator<Key>> m_Keys;
+    std::vector<int, ArenaAllocator<int>> m_Ids;
+    size_t m_Size;
 
-using IndexValue = std::pair<BoostPoint, int>;
+    // m_Generation changes whenever the tree is rebuilt, which invalidates
+    // searches in progress. Inserts only grow bounds and split leaves, which
+    // searches in progress tolerate.
+    int m_Generation;
+};
 
-using Index = boost::geometry::index::rtree<
-    IndexValue, boost::geometry::index::linear<4>>;
+// approximate number of bytes of index nodes per particle, used to plan the
+// arena capacity in Model::Reserve
+const size_t IndexBytesPerParticle = D == 2 ? 64 : 96;
 
 // Vector represents a point or a vector
 class Vector {
@@ -49,7 +817,8 @@ public:
     }
 
     BoostPoint ToBoost() const {
-        return BoostPoint(m_X, m_Y, m_Z);
+        return BoostPoint(
+            ToCoordinate(m_X), ToCoordinate(m_Y), ToCoordinate(m_Z));
     }
 
     double Length() const {
@@ -67,6 +836,17 @@ public:
         return std::sqrt(dx * dx + dy * dy + dz * dz);
     }
 
+    double Dot(const Vector &v) const {
+        return m_X * v.m_X + m_Y * v.m_Y + m_Z * v.m_Z;
+    }
+
+    Vector Cross(const Vector &v) const {
+        return Vector(
+            m_Y * v.m_Z - m_Z * v.m_Y,
+            m_Z * v.m_X - m_X * v.m_Z,
+            m_X * v.m_Y - m_Y * v.m_X);
+    }
+
     Vector Normalized() const {
         const double m = 1 / Length();
         return Vector(m_X * m, m_Y * m, m_Z * m);
@@ -95,17 +875,48 @@ private:
     double m_Z;
 };
 
+// particle positions are stored as Vectors, so keep them packed
+static_assert(sizeof(Vector) == 24, "Vector must hold exactly three doubles");
+
 // Lerp linearly interpolates from a to b by distance.
 Vector Lerp(const Vector &a, const Vector &b, const double d) {
     return a + (b - a).Normalized() * d;
 }
 
-// Random returns a uniformly distributed random number between lo and hi
-double Random(const double lo = 0, const double hi = 1) {
-    static thread_local std::mt19937 gen(
+// RandomGenerator returns the calling thread's random number generator. The
+// output of std::mt19937_64 is fully specified by the standard, unlike that of
+// the standard distributions, which are not used for this reason.
+std::mt19937_64 &RandomGenerator() {
+    static thread_local std::mt19937_64 gen(
         std::chrono::high_resolution_clock::now().time_since_epoch().count());
-    std::uniform_real_distribution<double> dist(lo, hi);
-    return dist(gen);
+    return gen;
+}
+
+// SeedRandom reseeds the calling thread's random number generator so that
+// the following random numbers form a reproducible stream
+void SeedRandom(const unsigned int seed) {
+    std::seed_seq seq{seed};
+    RandomGenerator().seed(seq);
+}
+
+// Quantize snaps a point to the fixed-point grid. It returns the point
+// unchanged when fixed-point mode is disabled.
+Vector Quantize(const Vector &p) {
+    if (FixedPointScale == 0) {
+        return p;
+    }
+    return Vector(
+        ToCoordinate(p.X()) * FixedPointUnit,
+        ToCoordinate(p.Y()) * FixedPointUnit,
+        ToCoordinate(p.Z()) * FixedPointUnit);
+}
+
+// Random returns a uniformly distributed random number between lo and hi.
+// The top 53 bits of one generator output form the mantissa of a number in
+// [0, 1), so the result is the same with every standard library.
+double Random(const double lo = 0, const double hi = 1) {
+    const double u = (RandomGenerator()() >> 11) * (1.0 / (1ull << 53));
+    return lo + (hi - lo) * u;
 }
 
 // RandomInUnitSphere returns a random, uniformly distributed point inside the
@@ -122,175 +933,4413 @@ Vector RandomInUnitSphere() {
     }
 }
 
-// Model holds all of the particles and defines their behavior.
-class Model {
+// BiasField is a vector field sampled onto a regular grid. Looking up a value
+// is a trilinear (bilinear in 2D) interpolation of the surrounding grid
+// nodes, which is much cheaper than evaluating an arbitrary analytic field
+// on every step of every walker. Points outside the grid use the value at
+// the nearest edge.
+class BiasField {
 public:
-    Model() :
-        m_ParticleSpacing(DefaultParticleSpacing),
-        m_AttractionDistance(DefaultAttractionDistance),
-        m_MinMoveDistance(DefaultMinMoveDistance),
-        m_Stubbornness(DefaultStubbornness),
-        m_Stickiness(DefaultStickiness),
-        m_BoundingRadius(0) {}
+    // the grid spans min to max with n nodes along each axis. in 2D the z
+    // axis is ignored and only one layer of nodes is stored. Throws
+    // std::invalid_argument if the grid has no extent along an axis.
+    BiasField(const Vector &min, const Vector &max, const int n) :
+        BiasField(min, max, n, n, D == 2 ? 1 : n) {}
 
-    void SetParticleSpacing(const double a) {
-        m_ParticleSpacing = a;
+    BiasField(
+        const Vector &min, const Vector &max,
+        const int nx, const int ny, const int nz) :
+        m_Min(min),
+        m_NX(std::max(nx, 2)),
+        m_NY(std::max(ny, 2)),
+        m_NZ(D == 2 ? 1 : std::max(nz, 2)),
+        m_Values(m_NX * m_NY * m_NZ)
+    {
+        const Vector size = max - min;
+        if (!(size.X() > 0) || !(size.Y() > 0) ||
+            (D == 3 && !(size.Z() > 0)))
+        {
+            throw std::invalid_argument("BiasField extent must be positive");
+        }
+        m_Scale = Vector(
+            (m_NX - 1) / size.X(),
+            (m_NY - 1) / size.Y(),
+            D == 2 ? 0 : (m_NZ - 1) / size.Z());
     }
 
-    void SetAttractionDistance(const double a) {
-        m_AttractionDistance = a;
+    // Sample evaluates the specified field at every grid node
+    void Sample(const std::function<Vector(const Vector &)> &field) {
+        for (int z = 0; z < m_NZ; z++) {
+            for (int y = 0; y < m_NY; y++) {
+                for (int x = 0; x < m_NX; x++) {
+                    m_Values[Offset(x, y, z)] =
+                        Planar(field(NodePosition(x, y, z)));
+                }
+            }
+        }
     }
 
-    void SetMinMoveDistance(const double a) {
-        m_MinMoveDistance = a;
+    // Load reads grid values from a text stream containing one "x y z" line
+    // per node, with x varying fastest. Returns false if the stream does not
+    // contain enough values.
+    bool Load(std::istream &in) {
+        for (Vector &v : m_Values) {
+            double x, y, z;
+            if (!(in >> x >> y >> z)) {
+                return false;
+            }
+            v = Planar(Vector(x, y, z));
+        }
+        return true;
     }
 
-    void SetStubbornness(const int a) {
-        m_Stubbornness = a;
+    // At returns the interpolated field value at the specified point
+    Vector At(const Vector &p) const {
+        int x, y, z = 0;
+        double tx, ty, tz = 0;
+        Locate((p.X() - m_Min.X()) * m_Scale.X(), m_NX, x, tx);
+        Locate((p.Y() - m_Min.Y()) * m_Scale.Y(), m_NY, y, ty);
+        if (D == 3) {
+            Locate((p.Z() - m_Min.Z()) * m_Scale.Z(), m_NZ, z, tz);
+        }
+        const Vector a = Bilerp(x, y, z, tx, ty);
+        if (D == 2) {
+            return a;
+        }
+        const Vector b = Bilerp(x, y, z + 1, tx, ty);
+        return a + (b - a) * tz;
     }
 
-    void SetStickiness(const double a) {
-        m_Stickiness = a;
+private:
+    // Planar drops the z component in 2D, so that the field cannot push
+    // walkers off the plane
+    static Vector Planar(const Vector &v) {
+        return D == 2 ? Vector(v.X(), v.Y()) : v;
     }
 
-    // Add adds a new particle with the specified parent particle
-    void Add(const Vector &p, const int parent = -1) {
-        const int id = m_Points.size();
-        m_Index.insert(std::make_pair(p.ToBoost(), id));
-        m_Points.push_back(p);
-        m_JoinAttempts.push_back(0);
-        m_BoundingRadius = std::max(
-            m_BoundingRadius, p.Length() + m_AttractionDistance);
-        std::cout
-            << id << "," << parent << ","
-            << p.X() << "," << p.Y() << "," << p.Z() << std::endl;
+    // Locate splits a continuous grid coordinate into the index of the lower
+    // node and the fraction towards the next node, clamping to the grid
+    static void Locate(const double f, const int n, int &i, double &t) {
+        if (!(f > 0)) {
+            i = 0; t = 0;
+        } else if (f >= n - 1) {
+            i = n - 2; t = 1;
+        } else {
+            i = (int)f; t = f - i;
+        }
     }
 
-    // Nearest returns the index of the particle nearest the specified point
-    int Nearest(const Vector &point) const {
-        int result = -1;
-        m_Index.query(
-            boost::geometry::index::nearest(point.ToBoost(), 1),
-            boost::make_function_output_iterator([&result](const auto &value) {
-                result = value.second;
-            }));
-        return result;
+    // Bilerp interpolates within one xy layer of the grid
+    Vector Bilerp(
+        const int x, const int y, const int z,
+        const double tx, const double ty) const
+    {
+        const int i = Offset(x, y, z);
+        const Vector &v00 = m_Values[i];
+        const Vector &v10 = m_Values[i + 1];
+        const Vector &v01 = m_Values[i + m_NX];
+        const Vector &v11 = m_Values[i + m_NX + 1];
+        const Vector a = v00 + (v10 - v00) * tx;
+        const Vector b = v01 + (v11 - v01) * tx;
+        return a + (b - a) * ty;
     }
 
-    // RandomStartingPosition returns a random point to start a new particle
-    Vector RandomStartingPosition() const {
-        const double d = m_BoundingRadius;
-        return RandomInUnitSphere().Normalized() * d;
+    int Offset(const int x, const int y, const int z) const {
+        return (z * m_NY + y) * m_NX + x;
     }
 
-    // ShouldReset returns true if the particle has gone too far away and
-    // should be reset to a new random starting position
-    bool ShouldReset(const Vector &p) const {
-        return p.Length() > m_BoundingRadius * 2;
+    Vector NodePosition(const int x, const int y, const int z) const {
+        return Vector(
+            m_Min.X() + x / m_Scale.X(),
+            m_Min.Y() + y / m_Scale.Y(),
+            D == 2 ? 0 : m_Min.Z() + z / m_Scale.Z());
     }
 
-    // ShouldJoin returns true if the point should attach to the specified
-    // parent particle. This is only called when the point is already within
-    // the required attraction distance.
-    bool ShouldJoin(const Vector &p, const int parent) {
-        m_JoinAttempts[parent]++;
-        if (m_JoinAttempts[parent] < m_Stubbornness) {
-            return false;
+    Vector m_Min;
+    Vector m_Scale;
+    int m_NX;
+    int m_NY;
+    int m_NZ;
+    std::vector<Vector> m_Values;
+};
+
+// PotentialGrid maintains the electric potential around a cluster on a
+// regular lattice for the dielectric breakdown model (DBM). Occupied cells
+// are held at potential 0 and cells outside the inscribed sphere of the grid
+// at potential 1; the potential of the remaining cells satisfies Laplace's
+// equation. After cells are occupied, Solve relaxes the potential around
+// them, starting from the previous solution, and every DBMFullSolveInterval
+// calls it runs multigrid V-cycles over the whole grid until the largest
+// residual drops below DBMTolerance.
+class PotentialGrid {
+public:
+    PotentialGrid(const int size, const double cellSize) :
+        m_Size(size),
+        m_CellSize(cellSize),
+        m_Layers(D == 2 ? 1 : size),
+        m_State(size * size * m_Layers, Free),
+        m_PerimeterSlots(size * size * m_Layers, -1),
+        m_Dirty(true),
+        m_LocalSolves(DBMFullSolveInterval)
+    {
+        // level 0 holds the potential itself and the coarser levels hold
+        // corrections, halving the resolution until the grid is small
+        int n = size;
+        int layers = m_Layers;
+        while (true) {
+            m_Levels.emplace_back(n, layers);
+            if (n <= DBMCoarsestSize) {
+                break;
+            }
+            n = (n + 1) / 2;
+            layers = D == 2 ? 1 : (layers + 1) / 2;
         }
-        return Random() <= m_Stickiness;
-    }
+        std::fill(m_Levels[0].U.begin(), m_Levels[0].U.end(), 1.0);
 
-    // PlaceParticle computes the final placement of the particle.
-    Vector PlaceParticle(const Vector &p, const int parent) const {
-        return Lerp(m_Points[parent], p, m_ParticleSpacing);
+        // everything outside the inscribed sphere (including the edges of
+        // the grid) is part of the fixed outer boundary
+        const double r = size / 2 - 1;
+        for (int z = 0; z < m_Layers; z++) {
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    const Vector v = CellPosition(x, y, z) * (1 / cellSize);
+                    if (v.LengthSquared() >= r * r) {
+                        m_State[Offset(x, y, z)] = Boundary;
+                        Fix(x, y, z);
+                    }
+                }
+            }
+        }
+    }
+
+    // Radius returns the radius of the outer boundary
+    double Radius() const {
+        return (m_Size / 2 - 1) * m_CellSize;
+    }
+
+    // Occupy marks the cell containing the specified point as part of the
+    // cluster. Returns false if the point lies on or beyond the outer
+    // boundary.
+    bool Occupy(const Vector &p) {
+        int x, y, z;
+        if (!Cell(p, x, y, z)) {
+            return false;
+        }
+        const int i = Offset(x, y, z);
+        if (m_State[i] == Boundary) {
+            return false;
+        }
+        if (m_State[i] == Occupied) {
+            return true;
+        }
+        RemovePerimeter(i);
+        m_State[i] = Occupied;
+        m_Levels[0].U[i] = 0;
+        Fix(x, y, z);
+        m_DirtyCells.push_back({{x, y, z}});
+        for (int k = 0; k < 2 * D; k++) {
+            const int j = i + m_Levels[0].Strides[k];
+            if (m_State[j] == Free && m_PerimeterSlots[j] < 0) {
+                m_PerimeterSlots[j] = m_Perimeter.size();
+                m_Perimeter.push_back(j);
+            }
+        }
+        m_Dirty = true;
+        return true;
+    }
+
+    // Solve brings the potential up to date with the occupied cells. Usually
+    // it only relaxes the cells around the ones occupied since the last
+    // call and returns 0. Every DBMFullSolveInterval calls it runs V-cycles
+    // until the largest residual is below DBMTolerance, or at most
+    // DBMMaxCycles of them, and returns the number of cycles run.
+    int Solve() {
+        if (!m_Dirty) {
+            return 0;
+        }
+        m_Dirty = false;
+        if (m_LocalSolves < DBMFullSolveInterval - 1) {
+            m_LocalSolves++;
+            for (const std::array<int, 3> &c : m_DirtyCells) {
+                SmoothWindow(c[0], c[1], c[2]);
+            }
+            m_DirtyCells.clear();
+            return 0;
+        }
+        m_LocalSolves = 0;
+        m_DirtyCells.clear();
+        int cycles = 0;
+        while (cycles < DBMMaxCycles && Residual(0, nullptr) > DBMTolerance) {
+            Cycle(0);
+            cycles++;
+        }
+        return cycles;
+    }
+
+    // ChooseGrowthSite picks a perimeter cell with probability proportional
+    // to its potential raised to the power eta and returns its center.
+    // Returns false if the cluster has no perimeter cells left.
+    bool ChooseGrowthSite(const double eta, Vector &result) const {
+        const std::vector<double> &phi = m_Levels[0].U;
+        double total = 0;
+        for (const int i : m_Perimeter) {
+            total += Weight(phi[i], eta);
+        }
+        if (m_Perimeter.empty() || total <= 0) {
+            return false;
+        }
+        double target = Random(0, total);
+        int chosen = m_Perimeter.back();
+        for (const int i : m_Perimeter) {
+            target -= Weight(phi[i], eta);
+            if (target <= 0) {
+                chosen = i;
+                break;
+            }
+        }
+        const int x = chosen % m_Size;
+        const int y = chosen / m_Size % m_Size;
+        const int z = chosen / (m_Size * m_Size);
+        result = CellPosition(x, y, z);
+        return true;
+    }
+
+private:
+    enum CellState : uint8_t {
+        Free,
+        Occupied,
+        Boundary,
+    };
+
+    // Level is one grid of the multigrid hierarchy. The equation on every
+    // level is 2D * u - (sum of the neighbors of u) = b on free cells, with
+    // u fixed on the others (to the potential on level 0, and to 0 for the
+    // corrections on coarser levels). Coarse cells are fixed if any of
+    // their fine cells are, and the outer boundary covers the edges of
+    // every level, so free cells never lie on an edge.
+    struct Level {
+        Level(const int size, const int layers) :
+            Size(size),
+            Layers(layers),
+            U(size * size * layers, 0),
+            B(size * size * layers, 0),
+            Fixed(size * size * layers, 0)
+        {
+            const int strides[] = {
+                1, -1, size, -size, size * size, -size * size};
+            for (int i = 0; i < 2 * D; i++) {
+                Strides[i] = strides[i];
+            }
+        }
+
+        int Size;
+        int Layers;
+        int Strides[2 * D];
+        std::vector<double> U;
+        std::vector<double> B;
+        std::vector<uint8_t> Fixed;
+    };
+
+    // Weight clamps the potential to [0, 1] before raising it to eta, as
+    // it is only solved to within DBMTolerance
+    static double Weight(const double phi, const double eta) {
+        const double p = std::min(std::max(phi, 0.0), 1.0);
+        return eta == 1 ? p : std::pow(p, eta);
+    }
+
+    // Fix marks the specified level 0 cell and the cells covering it on the
+    // coarser levels as fixed
+    void Fix(int x, int y, int z) {
+        for (Level &level : m_Levels) {
+            level.Fixed[(z * level.Size + y) * level.Size + x] = 1;
+            x /= 2;
+            y /= 2;
+            z /= 2;
+        }
+    }
+
+    // Smooth performs red-black Gauss-Seidel sweeps over the free cells of
+    // the specified level
+    void Smooth(const int l, const int iterations) {
+        Level &level = m_Levels[l];
+        const int n = level.Size;
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            for (int color = 0; color < 2; color++) {
+                for (int z = 0; z < level.Layers; z++) {
+                    for (int y = 1; y < n - 1; y++) {
+                        const int x0 = 1 + ((1 + y + z + color) & 1);
+                        for (int x = x0; x < n - 1; x += 2) {
+                            const int i = (z * n + y) * n + x;
+                            if (level.Fixed[i]) {
+                                continue;
+                            }
+                            double sum = level.B[i];
+                            for (int k = 0; k < 2 * D; k++) {
+                                sum += level.U[i + level.Strides[k]];
+                            }
+                            level.U[i] = sum / (2 * D);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // SmoothWindow performs DBMWindowSweeps red-black Gauss-Seidel sweeps
+    // over the free level 0 cells within DBMWindowRadius of the specified
+    // cell
+    void SmoothWindow(const int cx, const int cy, const int cz) {
+        Level &level = m_Levels[0];
+        const int n = level.Size;
+        const int r = DBMWindowRadius;
+        const int x0 = std::max(1, cx - r), x1 = std::min(n - 2, cx + r);
+        const int y0 = std::max(1, cy - r), y1 = std::min(n - 2, cy + r);
+        const int z0 = D == 2 ? 0 : std::max(1, cz - r);
+        const int z1 = D == 2 ? 0 : std::min(n - 2, cz + r);
+        for (int iteration = 0; iteration < DBMWindowSweeps; iteration++) {
+            for (int color = 0; color < 2; color++) {
+                for (int z = z0; z <= z1; z++) {
+                    for (int y = y0; y <= y1; y++) {
+                        int x = x0 + ((x0 + y + z + color) & 1);
+                        for (; x <= x1; x += 2) {
+                            const int i = (z * n + y) * n + x;
+                            if (level.Fixed[i]) {
+                                continue;
+                            }
+                            double sum = 0;
+                            for (int k = 0; k < 2 * D; k++) {
+                                sum += level.U[i + level.Strides[k]];
+                            }
+                            level.U[i] = sum / (2 * D);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Residual returns the largest residual on the specified level. If
+    // coarse is not null, the residuals are also restricted to its
+    // right-hand side: the coarse grid has twice the spacing, so the
+    // average residual of its fine cells is scaled by 4.
+    double Residual(const int l, Level *coarse) {
+        const Level &level = m_Levels[l];
+        const int n = level.Size;
+        const double scale = 4.0 / (D == 2 ? 4 : 8);
+        if (coarse) {
+            std::fill(coarse->B.begin(), coarse->B.end(), 0.0);
+        }
+        double result = 0;
+        for (int z = 0; z < level.Layers; z++) {
+            for (int y = 1; y < n - 1; y++) {
+                for (int x = 1; x < n - 1; x++) {
+                    const int i = (z * n + y) * n + x;
+                    if (level.Fixed[i]) {
+                        continue;
+                    }
+                    double r = level.B[i] - 2 * D * level.U[i];
+                    for (int k = 0; k < 2 * D; k++) {
+                        r += level.U[i + level.Strides[k]];
+                    }
+                    result = std::max(result, std::abs(r));
+                    if (coarse) {
+                        const int c = (z / 2 * coarse->Size + y / 2) *
+                            coarse->Size + x / 2;
+                        coarse->B[c] += r * scale;
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    // Cycle runs one V-cycle on the specified level
+    void Cycle(const int l) {
+        if (l + 1 == (int)m_Levels.size()) {
+            Smooth(l, DBMCoarsestSize * DBMCoarsestSize);
+            return;
+        }
+        Level &level = m_Levels[l];
+        Level &coarse = m_Levels[l + 1];
+        Smooth(l, DBMSmoothIterations);
+        Residual(l, &coarse);
+        std::fill(coarse.U.begin(), coarse.U.end(), 0.0);
+        Cycle(l + 1);
+        const int n = level.Size;
+        for (int z = 0; z < level.Layers; z++) {
+            for (int y = 1; y < n - 1; y++) {
+                for (int x = 1; x < n - 1; x++) {
+                    const int i = (z * n + y) * n + x;
+                    const int c = (z / 2 * coarse.Size + y / 2) *
+                        coarse.Size + x / 2;
+                    if (!level.Fixed[i]) {
+                        level.U[i] += coarse.U[c];
+                    }
+                }
+            }
+        }
+        Smooth(l, DBMSmoothIterations);
+    }
+
+    void RemovePerimeter(const int i) {
+        const int slot = m_PerimeterSlots[i];
+        if (slot < 0) {
+            return;
+        }
+        const int last = m_Perimeter.back();
+        m_Perimeter[slot] = last;
+        m_PerimeterSlots[last] = slot;
+        m_Perimeter.pop_back();
+        m_PerimeterSlots[i] = -1;
+    }
+
+    bool Cell(const Vector &p, int &x, int &y, int &z) const {
+        const int h = m_Size / 2;
+        x = std::lround(p.X() / m_CellSize) + h;
+        y = std::lround(p.Y() / m_CellSize) + h;
+        z = D == 2 ? 0 : std::lround(p.Z() / m_CellSize) + h;
+        return x >= 0 && x < m_Size && y >= 0 && y < m_Size &&
+            z >= 0 && z < m_Layers;
+    }
+
+    Vector CellPosition(const int x, const int y, const int z) const {
+        const int h = m_Size / 2;
+        return Vector(
+            (x - h) * m_CellSize,
+            (y - h) * m_CellSize,
+            D == 2 ? 0 : (z - h) * m_CellSize);
+    }
+
+    int Offset(const int x, const int y, const int z) const {
+        return (z * m_Size + y) * m_Size + x;
+    }
+
+    int m_Size;
+    double m_CellSize;
+    int m_Layers;
+    std::vector<Level> m_Levels;
+    std::vector<CellState> m_State;
+
+    // m_Perimeter lists the free cells adjacent to the cluster, and
+    // m_PerimeterSlots maps each cell to its slot in that list (or -1) so
+    // cells can be removed in constant time
+    std::vector<int> m_Perimeter;
+    std::vector<int> m_PerimeterSlots;
+
+    // m_Dirty is set when cells were occupied since the last Solve, and
+    // m_DirtyCells lists them. m_LocalSolves counts the calls to Solve
+    // since the last full solve.
+    bool m_Dirty;
+    std::vector<std::array<int, 3>> m_DirtyCells;
+    int m_LocalSolves;
+};
+
+// DeltaWriter writes particles in a compact binary format. Positions are
+// quantized to a fixed precision and stored as the difference from the
+// parent's quantized position, which is small because particles are placed
+// ParticleSpacing away from their parent. Parents are stored as the
+// difference between the particle id and the parent id. All integers are
+// varints, and the position deltas, which can be negative, are zigzag
+// encoded first.
+//
+// The stream starts with the magic "DLAF", a version byte, the number of
+// dimensions (one byte) and the precision (8-byte double). It is followed by
+// blocks of up to DeltaBlockSize particles, each starting with varints for
+// the first id, the particle count and the payload size in bytes, so readers
+// can skip blocks without decoding them. Each particle in the payload is
+// the parent offset (0 for seeds, id - parent otherwise) followed by one
+// delta per dimension. Deltas of seeds are relative to the origin.
+class DeltaWriter {
+public:
+    DeltaWriter(std::ostream &out, const double precision) :
+        m_Out(out),
+        m_Scale(1 / precision),
+        m_FirstID(0),
+        m_Count(0)
+    {
+        const uint8_t header[] = {'D', 'L', 'A', 'F', 1, D};
+        m_Out.write((const char *)header, sizeof(header));
+        m_Out.write((const char *)&precision, sizeof(precision));
+    }
+
+    DeltaWriter(const DeltaWriter &) = delete;
+    DeltaWriter &operator=(const DeltaWriter &) = delete;
+
+    ~DeltaWriter() {
+        Flush();
+    }
+
+    // Write adds a particle. Particles must be written in id order starting
+    // from 0, so that every parent has been written before its children.
+    // Throws std::out_of_range if a quantized coordinate does not fit in 32
+    // bits, and std::invalid_argument if the id or parent is out of order,
+    // in which case nothing is written.
+    void Write(const int id, const int parent, const Vector &p) {
+        if (id != (int)m_Quantized.size() || parent < -1 || parent >= id) {
+            throw std::invalid_argument(
+                "DeltaWriter: particles must be written in id order");
+        }
+        const int64_t q[] = {
+            std::llround(p.X() * m_Scale),
+            std::llround(p.Y() * m_Scale),
+            std::llround(p.Z() * m_Scale)};
+        for (int i = 0; i < D; i++) {
+            if (q[i] < INT32_MIN || q[i] > INT32_MAX) {
+                throw std::out_of_range(
+                    "DeltaWriter: position out of range for the precision");
+            }
+        }
+        if (m_Count == 0) {
+            m_FirstID = id;
+        }
+        m_Quantized.emplace_back();
+        for (int i = 0; i < D; i++) {
+            m_Quantized[id][i] = q[i];
+        }
+        PutVarint(m_Block, parent < 0 ? 0 : id - parent);
+        for (int i = 0; i < D; i++) {
+            const int64_t base = parent < 0 ? 0 : m_Quantized[parent][i];
+            PutVarint(m_Block, ZigZag(q[i] - base));
+        }
+        if (++m_Count == DeltaBlockSize) {
+            Flush();
+        }
+    }
+
+    // Flush writes out the pending block, if any
+    void Flush() {
+        if (m_Count == 0) {
+            return;
+        }
+        std::string header;
+        PutVarint(header, m_FirstID);
+        PutVarint(header, m_Count);
+        PutVarint(header, m_Block.size());
+        m_Out.write(header.data(), header.size());
+        m_Out.write(m_Block.data(), m_Block.size());
+        m_Out.flush();
+        m_Block.clear();
+        m_Count = 0;
+    }
+
+    static uint64_t ZigZag(const int64_t v) {
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    }
+
+    static int64_t UnZigZag(const uint64_t v) {
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+    static void PutVarint(std::string &out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((char)v);
+    }
+
+private:
+    std::ostream &m_Out;
+    double m_Scale;
+    int m_FirstID;
+    int m_Count;
+    std::string m_Block;
+
+    // m_Quantized stores the quantized position of every particle written
+    // so far (32 bits per axis, which covers a radius of 2 million units
+    // at the default precision; Write throws beyond that). Deltas are taken
+    // between quantized positions so that rounding errors do not accumulate
+    // along a branch.
+    std::vector<std::array<int32_t, D>> m_Quantized;
+};
+
+// DeltaReader reads particles written by DeltaWriter
+class DeltaReader {
+public:
+    explicit DeltaReader(std::istream &in) :
+        m_In(in),
+        m_Precision(0),
+        m_Remaining(0),
+        m_NextID(0),
+        m_Valid(false)
+    {
+        uint8_t header[6];
+        m_In.read((char *)header, sizeof(header));
+        m_In.read((char *)&m_Precision, sizeof(m_Precision));
+        m_Valid = m_In &&
+            std::equal(header, header + 4, "DLAF") &&
+            header[4] == 1 && header[5] == D;
+    }
+
+    // Valid returns false if the stream does not start with a compatible
+    // header
+    bool Valid() const {
+        return m_Valid;
+    }
+
+    // Next reads the next particle. Returns false at the end of the stream,
+    // and from then on, if the stream is corrupt: blocks must continue at
+    // the next id and parents must precede their children.
+    bool Next(int &id, int &parent, Vector &p) {
+        if (!m_Valid) {
+            return false;
+        }
+        if (m_Remaining == 0) {
+            uint64_t firstID, count, size;
+            if (!GetVarint(firstID) || !GetVarint(count) || !GetVarint(size)) {
+                return false;
+            }
+            if (firstID != (uint64_t)m_NextID || count == 0) {
+                m_Valid = false;
+                return false;
+            }
+            m_Remaining = count;
+        }
+        uint64_t offset;
+        if (!GetVarint(offset)) {
+            return false;
+        }
+        if (offset > (uint64_t)m_NextID) {
+            m_Valid = false;
+            return false;
+        }
+        id = m_NextID;
+        parent = offset == 0 ? -1 : id - (int)offset;
+        int64_t q[3] = {0, 0, 0};
+        for (int i = 0; i < D; i++) {
+            uint64_t v;
+            if (!GetVarint(v)) {
+                return false;
+            }
+            const int64_t base = parent < 0 ? 0 : m_Quantized[parent][i];
+            q[i] = base + DeltaWriter::UnZigZag(v);
+        }
+        m_NextID++;
+        m_Quantized.emplace_back();
+        for (int i = 0; i < D; i++) {
+            m_Quantized[id][i] = q[i];
+        }
+        p = Vector(q[0], q[1], q[2]) * m_Precision;
+        m_Remaining--;
+        return true;
+    }
+
+private:
+    bool GetVarint(uint64_t &v) {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const int c = m_In.get();
+            if (c == std::char_traits<char>::eof()) {
+                return false;
+            }
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::istream &m_In;
+    double m_Precision;
+    uint64_t m_Remaining;
+    int m_NextID;
+    bool m_Valid;
+    std::vector<std::array<int32_t, D>> m_Quantized;
+};
+
+// LogEntry is one committed particle in a ParticleLog
+struct LogEntry {
+    int ID;
+    int Parent;
+    Vector Position;
+};
+
+// ParticleLog is an append-only log of particles that one thread (the one
+// growing the model) writes while any number of other threads read it, e.g.
+// renderers or statistics collectors. Entries live in fixed-size chunks that
+// never move, and the writer publishes a high-water mark with a release
+// store after each entry is complete, so readers see committed entries
+// without locks and without copying, and the writer never waits for them.
+class ParticleLog {
+public:
+    ParticleLog() :
+        m_Chunks(ParticleLogMaxChunks),
+        m_Size(0) {}
+
+    ParticleLog(const ParticleLog &) = delete;
+    ParticleLog &operator=(const ParticleLog &) = delete;
+
+    // Append adds an entry. Must only be called by the writer thread.
+    void Append(const int id, const int parent, const Vector &p) {
+        const size_t n = m_Size.load(std::memory_order_relaxed);
+        const size_t chunk = n / ParticleLogChunkSize;
+        if (chunk >= m_Chunks.size()) {
+            throw std::length_error("ParticleLog capacity exceeded");
+        }
+        if (!m_Chunks[chunk]) {
+            m_Chunks[chunk].reset(new LogEntry[ParticleLogChunkSize]);
+        }
+        m_Chunks[chunk][n % ParticleLogChunkSize] = {id, parent, p};
+        m_Size.store(n + 1, std::memory_order_release);
+    }
+
+    // Size returns the number of committed entries. Entries below it can be
+    // read with At from any thread.
+    size_t Size() const {
+        return m_Size.load(std::memory_order_acquire);
+    }
+
+    const LogEntry &At(const size_t i) const {
+        return m_Chunks[i / ParticleLogChunkSize][i % ParticleLogChunkSize];
+    }
+
+    // Read calls f for each committed entry from index start on, one
+    // contiguous chunk span at a time, as f(const LogEntry *entries, count).
+    // Returns the index following the last entry read, which is the start
+    // for the next call.
+    template <typename F>
+    size_t Read(size_t start, F f) const {
+        const size_t end = Size();
+        while (start < end) {
+            const size_t offset = start % ParticleLogChunkSize;
+            const size_t count = std::min(
+                end - start, (size_t)ParticleLogChunkSize - offset);
+            f(&m_Chunks[start / ParticleLogChunkSize][offset], count);
+            start += count;
+        }
+        return end;
+    }
+
+private:
+    // m_Chunks is sized once up front and never reallocated, so readers can
+    // index it while the writer fills in new chunks. A chunk pointer is
+    // written before the release store of m_Size that makes it reachable.
+    std::vector<std::unique_ptr<LogEntry[]>> m_Chunks;
+    std::atomic<size_t> m_Size;
+};
+
+// SnapshotFrame is the header of one frame in a snapshot stream. It holds
+// summary statistics of the whole cluster as of the end of the frame.
+struct SnapshotFrame {
+    uint64_t Particles;
+    uint64_t WalkSteps;
+    uint32_t FirstID;
+    uint32_t Count;
+    double BoundingRadius;
+    double RadiusOfGyration;
+    uint32_t MaxDepth;
+    uint32_t PayloadSize;
+};
+
+// SnapshotParticle is one particle in a snapshot frame. Its id is the
+// frame's FirstID plus its index in the frame.
+struct SnapshotParticle {
+    int32_t Parent;
+    float X, Y, Z;
+};
+
+// SnapshotWriter writes an animation stream of frames, each holding the
+// particles added since the previous frame. A frame ends once the cluster
+// reaches a scheduled size: the next one is due after `every` more
+// particles or when the cluster has grown by `growth` times, whichever is
+// later, so frames can be evenly spaced, geometric, or both.
+//
+// The stream starts with the magic "DLAS", a version byte and the number of
+// dimensions (one byte). Each frame is a SnapshotFrame followed by
+// PayloadSize bytes of SnapshotParticle records, so players can find any
+// frame by skipping from header to header, and can hand a frame's payload
+// to the GPU as it is. Multi-byte values are in the byte order of the
+// machine that wrote them.
+class SnapshotWriter {
+public:
+    SnapshotWriter(std::ostream &out, const int every, const double growth) :
+        m_Out(out),
+        m_Every(std::max(every, 0)),
+        m_Growth(std::max(growth, 1.0)),
+        m_Next(0),
+        m_Frame(),
+        m_SumSquares(0)
+    {
+        const uint8_t header[] = {'D', 'L', 'A', 'S', 1, D};
+        m_Out.write((const char *)header, sizeof(header));
+        Schedule();
+    }
+
+    SnapshotWriter(const SnapshotWriter &) = delete;
+    SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+    ~SnapshotWriter() {
+        Flush();
+    }
+
+    void Write(
+        const int id, const int parent, const Vector &p,
+        const int depth, const uint64_t walkSteps)
+    {
+        if (m_Frame.Count == 0) {
+            m_Frame.FirstID = id;
+        }
+        m_Frame.Count++;
+        m_Frame.Particles = id + 1;
+        m_Frame.WalkSteps = walkSteps;
+        m_Frame.BoundingRadius = std::max(m_Frame.BoundingRadius, p.Length());
+        m_Frame.MaxDepth = std::max<uint32_t>(m_Frame.MaxDepth, depth);
+        m_Sum += p;
+        m_SumSquares += p.LengthSquared();
+        m_Particles.push_back(
+            {parent, (float)p.X(), (float)p.Y(), (float)p.Z()});
+        if (m_Frame.Particles >= m_Next) {
+            Flush();
+        }
+    }
+
+    // Flush ends the current frame early and writes it out, if it has any
+    // particles
+    void Flush() {
+        if (m_Frame.Count == 0) {
+            return;
+        }
+        const double n = m_Frame.Particles;
+        const Vector mean = m_Sum * (1 / n);
+        m_Frame.RadiusOfGyration = std::sqrt(
+            std::max(0.0, m_SumSquares / n - mean.LengthSquared()));
+        m_Frame.PayloadSize = m_Particles.size() * sizeof(SnapshotParticle);
+        m_Out.write((const char *)&m_Frame, sizeof(m_Frame));
+        m_Out.write((const char *)m_Particles.data(), m_Frame.PayloadSize);
+        m_Out.flush();
+        m_Particles.clear();
+        m_Frame.Count = 0;
+        Schedule();
+    }
+
+private:
+    // Schedule sets the cluster size at which the current frame ends
+    void Schedule() {
+        const uint64_t n = m_Frame.Particles;
+        m_Next = std::max<uint64_t>(
+            n + std::max(m_Every, 1),
+            std::ceil(n * m_Growth));
+    }
+
+    std::ostream &m_Out;
+    int m_Every;
+    double m_Growth;
+    uint64_t m_Next;
+
+    // m_Frame is the header of the current frame. The statistics in it
+    // cover all particles written so far.
+    SnapshotFrame m_Frame;
+    Vector m_Sum;
+    double m_SumSquares;
+    std::vector<SnapshotParticle> m_Particles;
+};
+
+// SnapshotReader reads a stream written by SnapshotWriter. It indexes the
+// frame headers when it is opened and then reads any frame directly.
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::istream &in) :
+        m_In(in),
+        m_Valid(false)
+    {
+        uint8_t header[6];
+        m_In.read((char *)header, sizeof(header));
+        m_Valid = m_In &&
+            std::equal(header, header + 4, "DLAS") &&
+            header[4] == 1 && header[5] == D;
+        if (!m_Valid) {
+            return;
+        }
+        std::streamoff offset = m_In.tellg();
+        m_In.seekg(0, std::ios::end);
+        const std::streamoff size = m_In.tellg();
+        m_In.seekg(offset);
+        // a truncated last frame (e.g. from a run that was killed) is
+        // ignored
+        SnapshotFrame frame;
+        while (offset + (std::streamoff)sizeof(frame) <= size &&
+            m_In.read((char *)&frame, sizeof(frame)))
+        {
+            offset += sizeof(frame);
+            if (offset + frame.PayloadSize > size) {
+                break;
+            }
+            m_Frames.push_back(frame);
+            m_Offsets.push_back(offset);
+            offset += frame.PayloadSize;
+            m_In.seekg(offset);
+        }
+        m_In.clear();
+    }
+
+    // Valid returns false if the stream does not start with a compatible
+    // header
+    bool Valid() const {
+        return m_Valid;
+    }
+
+    // Frames returns the headers of all complete frames
+    const std::vector<SnapshotFrame> &Frames() const {
+        return m_Frames;
+    }
+
+    // Find returns the index of the first frame that brings the cluster to
+    // at least the specified number of particles, or the number of frames
+    // if there is none
+    int Find(const uint64_t particles) const {
+        return std::lower_bound(
+            m_Frames.begin(), m_Frames.end(), particles,
+            [](const SnapshotFrame &frame, const uint64_t n) {
+                return frame.Particles < n;
+            }) - m_Frames.begin();
+    }
+
+    // Read appends the particles of the specified frame to entries. Reading
+    // frames 0 through i gives the cluster as of frame i.
+    bool Read(const int frame, std::vector<LogEntry> &entries) {
+        const SnapshotFrame &f = m_Frames[frame];
+        std::vector<SnapshotParticle> particles(f.Count);
+        m_In.seekg(m_Offsets[frame]);
+        if (!m_In.read((char *)particles.data(), f.PayloadSize)) {
+            m_In.clear();
+            return false;
+        }
+        for (uint32_t i = 0; i < f.Count; i++) {
+            const SnapshotParticle &p = particles[i];
+            entries.push_back({
+                (int)(f.FirstID + i), p.Parent, Vector(p.X, p.Y, p.Z)});
+        }
+        return true;
+    }
+
+private:
+    std::istream &m_In;
+    bool m_Valid;
+    std::vector<SnapshotFrame> m_Frames;
+    std::vector<std::streamoff> m_Offsets;
+};
+
+// the phases of Model::AddParticle measured by PerfCounters: nearest
+// neighbor queries, the rest of the random walk (random numbers, motion and
+// join tests) and adding the particle (index insertion and output)
+enum PerfPhase {
+    PerfPhaseQuery,
+    PerfPhaseMotion,
+    PerfPhaseAdd,
+    PerfPhaseCount
+};
+
+// the hardware events counted by PerfCounters
+enum PerfEvent {
+    PerfEventCycles,
+    PerfEventInstructions,
+    PerfEventCacheMisses,
+    PerfEventBranchMisses,
+    PerfEventCount
+};
+
+// PerfCounters counts hardware events with perf_event_open and attributes
+// them to the phases of AddParticle (see Model::SetPerfCounters). The
+// counters are opened as one group for the calling thread, in user space
+// only, so they must be created on the thread that grows the model. Events
+// the machine does not support (e.g. hardware events in most VMs, or with a
+// restrictive perf_event_paranoid setting) are reported as unavailable.
+// The counters are read with a group read, a system call per phase. With
+// userRead they are read with rdpmc instead where the kernel allows it,
+// which avoids the system call. A particle during which the group was taken
+// off the PMU, e.g. because other events were multiplexed with it, is
+// discarded rather than reported incomplete.
+class PerfCounters {
+public:
+    explicit PerfCounters(const bool userRead = false) :
+        m_Leader(-1),
+        m_Phase(-1),
+        m_Spoiled(false),
+        m_Gap(0),
+        m_Particles(0),
+        m_Samples(0),
+        m_Discarded(0),
+        m_UserReads(0),
+        m_Last(),
+        m_Current(),
+        m_Totals()
+    {
+        for (int i = 0; i < PerfEventCount; i++) {
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = Events[i].Type;
+            attr.config = Events[i].Config;
+            attr.disabled = m_Leader < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format =
+                PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                PERF_FORMAT_TOTAL_TIME_RUNNING;
+            const int fd = syscall(
+                __NR_perf_event_open, &attr, 0, -1, m_Leader, 0);
+            m_Slots[i] = -1;
+            if (fd < 0) {
+                continue;
+            }
+            if (m_Leader < 0) {
+                m_Leader = fd;
+            }
+            m_Slots[i] = m_Fds.size();
+            m_Fds.push_back(fd);
+        }
+        // the mapped pages let the counters be read with rdpmc
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; userRead && i < m_Fds.size(); i++) {
+            void *page = mmap(
+                nullptr, pageSize, PROT_READ, MAP_SHARED, m_Fds[i], 0);
+            if (page == MAP_FAILED) {
+                UnmapPages();
+                break;
+            }
+            m_Pages.push_back((perf_event_mmap_page *)page);
+        }
+        if (m_Leader >= 0) {
+            ioctl(m_Leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(m_Leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    ~PerfCounters() {
+        UnmapPages();
+        for (const int fd : m_Fds) {
+            close(fd);
+        }
+    }
+
+    // Available returns true if at least one event could be opened
+    bool Available() const {
+        return m_Leader >= 0;
+    }
+
+    // Sample is called once per particle and returns true for the particles
+    // that should be measured
+    bool Sample() {
+        return Available() && m_Particles++ % PerfSampleInterval == 0;
+    }
+
+    // Active returns true while a particle is being measured
+    bool Active() const {
+        return m_Phase >= 0;
+    }
+
+    // UserReads returns how many times the counters were read with rdpmc
+    uint64_t UserReads() const {
+        return m_UserReads;
+    }
+
+    // Mean returns the mean count of the specified event in the specified
+    // phase per measured particle, or -1 if the event is not available
+    double Mean(const int phase, const int event) const {
+        const int slot = m_Slots[event];
+        if (slot < 0 || m_Samples == 0) {
+            return -1;
+        }
+        return (double)m_Totals[phase][slot] / m_Samples;
+    }
+
+    // Switch attributes the events since the last call to the current phase
+    // and starts the specified one
+    void Switch(const int phase) {
+        uint64_t values[PerfEventCount];
+        uint64_t gap;
+        bool ok = ReadUser(values, gap);
+        if (ok) {
+            m_UserReads++;
+        } else {
+            ok = ReadGroup(values, gap);
+        }
+        if (!ok) {
+            m_Spoiled = true;
+        } else {
+            if (m_Phase >= 0) {
+                // the group was off the PMU for a while if the time it was
+                // enabled grew more than the time it was running
+                m_Spoiled |= gap != m_Gap;
+                for (size_t i = 0; i < m_Fds.size(); i++) {
+                    m_Current[m_Phase][i] += values[i] - m_Last[i];
+                }
+            }
+            std::copy(values, values + m_Fds.size(), m_Last);
+            m_Gap = gap;
+        }
+        m_Phase = phase;
+    }
+
+    // Stop ends the measurement of a particle and adds it to the totals,
+    // unless the counters missed some of it
+    void Stop() {
+        Switch(-1);
+        for (int phase = 0; phase < PerfPhaseCount; phase++) {
+            for (size_t i = 0; i < m_Fds.size(); i++) {
+                if (!m_Spoiled) {
+                    m_Totals[phase][i] += m_Current[phase][i];
+                }
+                m_Current[phase][i] = 0;
+            }
+        }
+        if (m_Spoiled) {
+            m_Discarded++;
+        } else {
+            m_Samples++;
+        }
+        m_Spoiled = false;
+    }
+
+    // Write reports the events of each phase per million particles
+    void Write(std::ostream &out) const {
+        static const char *phases[] = {"query", "motion", "add"};
+        if (!Available()) {
+            out << "perf counters unavailable" << std::endl;
+            return;
+        }
+        out
+            << "perf counters per million particles (" << m_Samples
+            << " of " << m_Particles << " particles measured, "
+            << m_Discarded << " discarded):" << std::endl;
+        if (m_Samples == 0) {
+            return;
+        }
+        for (int phase = 0; phase < PerfPhaseCount; phase++) {
+            out << "  " << phases[phase] << ":";
+            for (int i = 0; i < PerfEventCount; i++) {
+                out << (i ? ", " : " ");
+                const double mean = Mean(phase, i);
+                if (mean < 0) {
+                    out << "n/a";
+                } else {
+                    out << mean * 1e6;
+                }
+                out << " " << Events[i].Name;
+            }
+            const double cycles = Mean(phase, PerfEventCycles);
+            const double instructions = Mean(phase, PerfEventInstructions);
+            if (cycles > 0 && instructions >= 0) {
+                out << " (" << instructions / cycles << " IPC)";
+            }
+            out << std::endl;
+        }
+    }
+
+private:
+    struct Event {
+        uint32_t Type;
+        uint64_t Config;
+        const char *Name;
+    };
+
+    // ReadUser reads the counters with rdpmc, without entering the kernel,
+    // and stores how much longer the group has been enabled than running.
+    // It returns false if the kernel does not allow it or the group is not
+    // on the PMU right now.
+    bool ReadUser(uint64_t *values, uint64_t &gap) const {
+#if defined(__x86_64__) || defined(__i386__)
+        if (m_Pages.empty()) {
+            return false;
+        }
+        for (size_t i = 0; i < m_Pages.size(); i++) {
+            const volatile perf_event_mmap_page *page = m_Pages[i];
+            uint32_t seq;
+            do {
+                // the kernel updates the page under a sequence lock
+                seq = page->lock;
+                __asm__ __volatile__("" ::: "memory");
+                const uint32_t index = page->index;
+                if (!page->cap_user_rdpmc || index == 0) {
+                    return false;
+                }
+                uint32_t lo, hi;
+                __asm__ __volatile__(
+                    "rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+                // the hardware counter is pmc_width bits wide and signed
+                const int shift = 64 - page->pmc_width;
+                const int64_t count =
+                    (int64_t)(((uint64_t)hi << 32 | lo) << shift) >> shift;
+                values[i] = page->offset + count;
+                if (i == 0) {
+                    gap = page->time_enabled - page->time_running;
+                }
+                __asm__ __volatile__("" ::: "memory");
+            } while (page->lock != seq);
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // ReadGroup reads the counters with a system call, like ReadUser
+    bool ReadGroup(uint64_t *values, uint64_t &gap) const {
+        // the number of events, the times the group has been enabled and
+        // running, and then one value per event
+        uint64_t data[3 + PerfEventCount];
+        const size_t size = (3 + m_Fds.size()) * sizeof(uint64_t);
+        if (read(m_Leader, data, size) != (ssize_t)size) {
+            return false;
+        }
+        gap = data[1] - data[2];
+        std::copy(data + 3, data + 3 + m_Fds.size(), values);
+        return true;
+    }
+
+    void UnmapPages() {
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        for (perf_event_mmap_page *page : m_Pages) {
+            munmap(page, pageSize);
+        }
+        m_Pages.clear();
+    }
+
+    static constexpr Event Events[PerfEventCount] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses"}};
+
+    // m_Fds holds the opened events, led by m_Leader, in the order in
+    // which a group read returns them. m_Slots maps each of Events to its
+    // position there, or -1 if it could not be opened.
+    std::vector<int> m_Fds;
+    int m_Slots[PerfEventCount];
+    int m_Leader;
+
+    // m_Pages holds the mapped page of each of m_Fds if rdpmc was asked
+    // for, and is empty otherwise
+    std::vector<perf_event_mmap_page *> m_Pages;
+
+    // m_Phase is the phase being measured, or -1 between particles.
+    // m_Spoiled is set when the counters missed part of the particle, and
+    // m_Gap is how much longer the group had been enabled than running at
+    // the last read.
+    int m_Phase;
+    bool m_Spoiled;
+    uint64_t m_Gap;
+    uint64_t m_Particles;
+    uint64_t m_Samples;
+    uint64_t m_Discarded;
+    uint64_t m_UserReads;
+    uint64_t m_Last[PerfEventCount];
+    uint64_t m_Current[PerfPhaseCount][PerfEventCount];
+    uint64_t m_Totals[PerfPhaseCount][PerfEventCount];
+};
+
+constexpr PerfCounters::Event PerfCounters::Events[];
+
+// Model holds all of the particles and defines their behavior.
+class Model {
+public:
+    Model() :
+        m_ParticleSpacing(DefaultParticleSpacing),
+        m_AttractionDistance(DefaultAttractionDistance),
+        m_MinMoveDistance(DefaultMinMoveDistance),
+        m_Stubbornness(DefaultStubbornness),
+        m_Stickiness(DefaultStickiness),
+        m_BoundingRadius(0),
+        m_PeriodicWidth(0),
+        m_MinHeight(0),
+        m_MaxHeight(0),
+        m_AdaptiveLaunch(false),
+        m_LaunchRadius(0),
+        m_ParticleCount(0),
+        m_WalkSteps(0),
+        m_Resets(0),
+        m_JoinRejections(0),
+        m_PublishedBoundingRadius(0),
+        m_PublishedFrozenSize(0),
+        m_Output(&std::cout),
+        m_Log(nullptr),
+        m_PerfCounters(nullptr),
+        m_BiasField(nullptr),
+        m_DBMEta(1),
+        m_EdenSynced(0),
+        m_Frozen(&m_Arena),
+        m_Frontier(&m_Arena) {}
+
+    // the index refers to the model's arena, so models cannot be copied
+    Model(const Model &) = delete;
+    Model &operator=(const Model &) = delete;
+
+    void SetParticleSpacing(const double a) {
+        m_ParticleSpacing = a;
+    }
+
+    void SetAttractionDistance(const double a) {
+        m_AttractionDistance = a;
+    }
+
+    void SetMinMoveDistance(const double a) {
+        m_MinMoveDistance = a;
+    }
+
+    // SetStubbornness sets the number of join attempts required before a
+    // particle accepts another. Join attempts are counted in 16 bits, so the
+    // value is limited to 65535.
+    void SetStubbornness(const int a) {
+        m_Stubbornness = std::max(0, std::min(a, (int)UINT16_MAX));
+    }
+
+    void SetStickiness(const double a) {
+        m_Stickiness = a;
+    }
+
+    // SetPeriodicBox switches to growth in a periodic box of the specified
+    // width: a strip in 2D (periodic in x) or a slab in 3D (periodic in x and
+    // z), growing in +y from seeds placed on a substrate, e.g. a row of
+    // particles at y = 0. Positions are kept in [0, width). Walkers are
+    // launched uniformly from a plane just above the highest particle and
+    // relaunched when they rise 2 * width above it, where the distribution
+    // of their return position is uniform to within exp(-4 pi). Not
+    // compatible with SetAdaptiveLaunch or the dielectric breakdown mode.
+    // Pass 0 to disable.
+    void SetPeriodicBox(const double width) {
+        m_PeriodicWidth = width;
+    }
+
+    // SetAdaptiveLaunch enables a tighter launch sphere and exact walker
+    // returns. The launch sphere is centered on the cluster's bounding box
+    // when that gives a smaller sphere than one centered on the origin, which
+    // helps clusters that grow off-center or along one direction. Walkers
+    // that leave the sphere are not killed but jump straight back onto it,
+    // at a point drawn from the harmonic measure seen from their position
+    // (in 3D they escape with probability 1 - R/r and are relaunched
+    // uniformly). Both are exact, so growth statistics are unchanged.
+    void SetAdaptiveLaunch(const bool a) {
+        m_AdaptiveLaunch = a;
+    }
+
+    // SetOutput sets the stream that particles are written to as they are
+    // added. Pass nullptr to disable output.
+    void SetOutput(std::ostream *output) {
+        m_Output = output;
+    }
+
+    // SetDeltaOutput writes particles as they are added to the specified
+    // stream in the compact delta-encoded format (see DeltaWriter), in
+    // addition to any CSV output set with SetOutput. Particles already in the
+    // model are written first. The stream must outlive the model or be
+    // flushed with Flush. Pass nullptr to disable.
+    void SetDeltaOutput(
+        std::ostream *output,
+        const double precision = DefaultOutputPrecision)
+    {
+        m_DeltaWriter.reset(
+            output ? new DeltaWriter(*output, precision) : nullptr);
+        if (m_DeltaWriter) {
+            for (int id = 0; id < (int)m_Points.size(); id++) {
+                m_DeltaWriter->Write(id, m_Parents[id], m_Points[id]);
+            }
+        }
+    }
+
+    // SetSnapshotOutput writes an animation stream of frames to the specified
+    // stream (see SnapshotWriter). A frame ends after `every` particles or
+    // when the cluster has grown by a factor of `growth`, whichever is
+    // later; e.g. (1000, 1) gives a frame every 1000 particles and (1, 1.1)
+    // a frame at every 10% of growth. Particles already in the model are
+    // written first, so the stream always holds the whole cluster. The
+    // stream must outlive the model or be flushed with Flush, which also
+    // ends the current frame. Pass nullptr to disable.
+    void SetSnapshotOutput(
+        std::ostream *output, const int every, const double growth = 1)
+    {
+        m_SnapshotWriter.reset(
+            output ? new SnapshotWriter(*output, every, growth) : nullptr);
+        if (m_SnapshotWriter) {
+            for (int id = 0; id < (int)m_Points.size(); id++) {
+                m_SnapshotWriter->Write(
+                    id, m_Parents[id], m_Points[id], m_Depths[id],
+                    WalkSteps());
+            }
+        }
+    }
+
+    // SetLog appends every particle added to the specified log, which other
+    // threads can read concurrently. The log is not owned by the model and
+    // must outlive it. Pass nullptr to disable.
+    void SetLog(ParticleLog *log) {
+        m_Log = log;
+    }
+
+    // SetPerfCounters measures the phases of AddParticle for one in
+    // PerfSampleInterval particles with the specified counters, which are
+    // not owned by the model. AddParticles and the other growth modes are
+    // not measured. Pass nullptr to disable.
+    void SetPerfCounters(PerfCounters *counters) {
+        m_PerfCounters = counters;
+    }
+
+    // Flush writes out any buffered output
+    void Flush() {
+        if (m_Output) {
+            m_Output->flush();
+        }
+        if (m_DeltaWriter) {
+            m_DeltaWriter->Flush();
+        }
+        if (m_SnapshotWriter) {
+            m_SnapshotWriter->Flush();
+        }
+    }
+
+    // SetBiasField sets a field that is added to the random direction in
+    // MotionVector, giving the walk a position-dependent drift. The field is
+    // not copied and must outlive the model. Pass nullptr to disable.
+    void SetBiasField(const BiasField *field) {
+        m_BiasField = field;
+    }
+
+    // SetDielectricBreakdown enables growth with AddParticleDBM. The
+    // potential is maintained on a grid with the specified number of cells
+    // per axis, spaced ParticleSpacing apart and centered on the origin.
+    // Growth probability is proportional to the potential to the power eta.
+    void SetDielectricBreakdown(const int gridSize, const double eta = 1) {
+        m_Potential.reset(new PotentialGrid(gridSize, m_ParticleSpacing));
+        m_DBMEta = eta;
+        for (const Vector &p : m_Points) {
+            m_Potential->Occupy(p);
+        }
+    }
+
+    // SetUseArena selects whether the spatial index allocates its nodes from
+    // the model's arena or directly from the system. It must be called before
+    // any particles are added, and throws std::logic_error otherwise.
+    void SetUseArena(const bool a) {
+        m_Arena.SetEnabled(a);
+    }
+
+    // Reserve pre-plans storage for the specified total number of particles
+    // so that neither the particle arrays nor the spatial index need to grow
+    // during the run. Optionally backs the index arena with huge pages.
+    void Reserve(const int particles, const bool hugePages = false) {
+        m_Points.reserve(particles);
+        if (m_Stubbornness > 0) {
+            m_JoinAttempts.reserve(particles);
+        }
+        m_Parents.reserve(particles);
+        m_Depths.reserve(particles);
+        m_BranchOrders.reserve(particles);
+        m_MaxChildOrders.reserve(particles);
+        m_MaxChildCounts.reserve(particles);
+        m_Arena.SetHugePages(hugePages);
+        // the arena holds the static tier and the frontier tier, which is
+        // frozen before it exceeds a third of the static tier
+        m_Arena.Reserve(
+            (particles + particles / (FrontierFraction - 1) +
+            FrontierMinSize) * IndexBytesPerParticle);
+    }
+
+    // GetArena returns the arena backing the spatial index, which tracks
+    // allocation statistics
+    const Arena &GetArena() const {
+        return m_Arena;
+    }
+
+    // Add adds a new particle with the specified parent particle
+    void Add(const Vector &point, const int parent = -1) {
+        if (m_PerfCounters && m_PerfCounters->Active()) {
+            m_PerfCounters->Switch(PerfPhaseAdd);
+        }
+        const Vector p = Quantize(Wrap(point));
+        const int id = m_Points.size();
+        if (id == 0) {
+            // the frontier is reserved up front (here, and at every freeze)
+            // for as many keys as it can hold before the next freeze, so
+            // that it never grows and leaves old buffers in the arena
+            m_Frontier.Reserve(FrontierMinSize + 1);
+        }
+        m_Frontier.Insert(ToKey(p.ToBoost()), id);
+        m_Points.push_back(p);
+        if (m_Frontier.Size() > (size_t)FrontierMinSize &&
+            m_Frontier.Size() > m_Points.size() / FrontierFraction)
+        {
+            Freeze();
+        }
+        AddToTree(id, parent);
+        if (m_Potential) {
+            m_Potential->Occupy(p);
+        }
+        m_BoundingRadius = std::max(
+            m_BoundingRadius, p.Length() + m_AttractionDistance);
+        UpdateLaunchSphere(p);
+        if (id == 0) {
+            m_MinHeight = p.Y();
+            m_MaxHeight = p.Y();
+        }
+        m_MinHeight = std::min(m_MinHeight, p.Y());
+        m_MaxHeight = std::max(m_MaxHeight, p.Y());
+        m_ParticleCount.store(id + 1, std::memory_order_relaxed);
+        m_PublishedBoundingRadius.store(
+            m_BoundingRadius, std::memory_order_relaxed);
+        if (m_Output) {
+            *m_Output
+                << id << "," << parent << ","
+                << p.X() << "," << p.Y() << "," << p.Z() << std::endl;
+        }
+        if (m_DeltaWriter) {
+            m_DeltaWriter->Write(id, parent, p);
+        }
+        if (m_SnapshotWriter) {
+            m_SnapshotWriter->Write(
+                id, parent, p, m_Depths[id], WalkSteps());
+        }
+        if (m_Log) {
+            m_Log->Append(id, parent, p);
+        }
+    }
+
+    // Size returns the number of particles in the model
+    int Size() const {
+        return m_Points.size();
+    }
+
+    // JoinAttempts returns how many times other particles have attempted to
+    // join with the specified particle. Only counted while stubbornness is
+    // enabled, and saturates at 65535.
+    int JoinAttempts(const int id) const {
+        return (size_t)id < m_JoinAttempts.size() ? m_JoinAttempts[id] : 0;
+    }
+
+    // Position returns the position of the specified particle
+    const Vector &Position(const int id) const {
+        return m_Points[id];
+    }
+
+    // Particles and Parents return the particle storage, e.g. to share it
+    // without copying. The pointers stay valid as long as the model does not
+    // grow beyond Capacity particles (see Reserve).
+    const Vector *Particles() const {
+        return m_Points.data();
+    }
+
+    const int *Parents() const {
+        return m_Parents.data();
+    }
+
+    int Capacity() const {
+        return std::min(m_Points.capacity(), m_Parents.capacity());
+    }
+
+    // JoinAttemptsStorage returns the join attempt counters like Particles.
+    // They are only allocated once needed, so this allocates them for
+    // Capacity particles.
+    const uint16_t *JoinAttemptsStorage() {
+        if (m_JoinAttempts.size() < (size_t)Capacity()) {
+            m_JoinAttempts.resize(Capacity());
+        }
+        return m_JoinAttempts.data();
+    }
+
+    // ParticleSpacing returns the distance between joined particles
+    double ParticleSpacing() const {
+        return m_ParticleSpacing;
+    }
+
+    double AttractionDistance() const {
+        return m_AttractionDistance;
+    }
+
+    double MinMoveDistance() const {
+        return m_MinMoveDistance;
+    }
+
+    // BoundingRadius returns the radius of the sphere around the origin that
+    // bounds all particles, including the attraction distance
+    double BoundingRadius() const {
+        return m_BoundingRadius;
+    }
+
+    // the following counters may be read from other threads while the model
+    // is growing, e.g. by a MetricsExporter
+
+    // ParticleCount returns the number of particles added so far
+    uint64_t ParticleCount() const {
+        return m_ParticleCount.load(std::memory_order_relaxed);
+    }
+
+    // WalkSteps returns the total number of random walk steps taken
+    uint64_t WalkSteps() const {
+        return m_WalkSteps.load(std::memory_order_relaxed);
+    }
+
+    // Resets returns the number of times a walker was reset for going too
+    // far away
+    uint64_t Resets() const {
+        return m_Resets.load(std::memory_order_relaxed);
+    }
+
+    // JoinRejections returns the number of times ShouldJoin returned false
+    uint64_t JoinRejections() const {
+        return m_JoinRejections.load(std::memory_order_relaxed);
+    }
+
+    // PublishedBoundingRadius returns the bounding radius as of the last
+    // particle added
+    double PublishedBoundingRadius() const {
+        return m_PublishedBoundingRadius.load(std::memory_order_relaxed);
+    }
+
+    // FrozenIndexSize returns the number of particles in the static tier of
+    // the spatial index. The others are in the frontier tier.
+    uint64_t FrozenIndexSize() const {
+        return m_PublishedFrozenSize.load(std::memory_order_relaxed);
+    }
+
+    // Nearest returns the index of the particle nearest the specified point
+    int Nearest(const Vector &point) const {
+        DistanceSquared distanceSquared =
+            std::numeric_limits<DistanceSquared>::max();
+        return NearestKey(point.ToBoost(), -1, distanceSquared);
+    }
+
+    // Nearest returns the index of the particle nearest the specified point
+    // and stores the squared distance to it, computed from the index key so
+    // that the particle itself need not be loaded
+    int Nearest(const Vector &point, DistanceSquared &distanceSquared) const {
+        distanceSquared = std::numeric_limits<DistanceSquared>::max();
+        int result = NearestKey(point.ToBoost(), -1, distanceSquared);
+        if (m_PeriodicWidth > 0) {
+            result = NearestImage(point, result, distanceSquared);
+        }
+        return result;
+    }
+
+    // RandomStartingPosition returns a random point to start a new particle
+    Vector RandomStartingPosition() const {
+        if (m_PeriodicWidth > 0) {
+            const double w = m_PeriodicWidth;
+            return Vector(
+                Random(0, w),
+                m_MaxHeight + m_AttractionDistance,
+                D == 2 ? 0 : Random(0, w));
+        }
+        if (m_AdaptiveLaunch) {
+            return m_LaunchCenter +
+                RandomInUnitSphere().Normalized() * m_LaunchRadius;
+        }
+        const double d = m_BoundingRadius;
+        return RandomInUnitSphere().Normalized() * d;
+    }
+
+    // ShouldReset returns true if the particle has gone too far away and
+    // should be reset to a new position with ResetPosition
+    bool ShouldReset(const Vector &p) const {
+        if (m_PeriodicWidth > 0) {
+            const double launch = m_MaxHeight + m_AttractionDistance;
+            return p.Y() > launch + m_PeriodicWidth * 2 ||
+                p.Y() < m_MinHeight - m_AttractionDistance;
+        }
+        if (m_AdaptiveLaunch) {
+            const double r = m_LaunchRadius;
+            return (p - m_LaunchCenter).LengthSquared() > r * r;
+        }
+        const double r = m_BoundingRadius * 2;
+        return p.LengthSquared() > r * r;
+    }
+
+    // ResetPosition returns the position at which a particle that has gone
+    // too far away continues its walk
+    Vector ResetPosition(const Vector &p) const {
+        if (!m_AdaptiveLaunch) {
+            return RandomStartingPosition();
+        }
+
+        // the walker is outside the launch sphere, where there are no
+        // particles, so it can jump straight to the point where it would
+        // first hit the sphere again (the exterior Poisson kernel)
+        const Vector offset = p - m_LaunchCenter;
+        const double r = offset.Length();
+        const double rho = r / m_LaunchRadius;
+        const Vector axis = offset * (1 / r);
+        if (D == 2) {
+            // wrapped Cauchy distribution of the angle with q = 1 / rho
+            const double q = 1 / rho;
+            const double t = std::tan(M_PI * (Random() - 0.5));
+            const double a = 2 * std::atan((1 - q) / (1 + q) * t);
+            const double c = std::cos(a);
+            const double s = std::sin(a);
+            const Vector v(
+                axis.X() * c - axis.Y() * s,
+                axis.X() * s + axis.Y() * c);
+            return m_LaunchCenter + v * m_LaunchRadius;
+        }
+
+        // in 3D the walker escapes to infinity with probability 1 - 1 / rho,
+        // in which case it comes back uniformly distributed
+        if (Random() > 1 / rho) {
+            return RandomStartingPosition();
+        }
+
+        // otherwise invert the cdf of the hitting distribution of the angle
+        // between the walker's direction and the hit point
+        const double s = 2 * Random() / (rho * rho - 1) + 1 / (1 + rho);
+        const double cosTheta = std::max(-1.0, std::min(1.0,
+            (1 + rho * rho - 1 / (s * s)) / (2 * rho)));
+        const double sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+        const double phi = Random(0, 2 * M_PI);
+        const Vector helper = std::abs(axis.X()) < 0.9 ?
+            Vector(1, 0, 0) : Vector(0, 1, 0);
+        const Vector u = axis.Cross(helper).Normalized();
+        const Vector w = axis.Cross(u);
+        const Vector v =
+            axis * cosTheta +
+            u * (sinTheta * std::cos(phi)) +
+            w * (sinTheta * std::sin(phi));
+        return m_LaunchCenter + v * m_LaunchRadius;
+    }
+
+    // ShouldJoin returns true if the point should attach to the specified
+    // parent particle. This is only called when the point is already within
+    // the required attraction distance.
+    bool ShouldJoin(const Vector &p, const int parent) {
+        if (m_Stubbornness > 0) {
+            if (m_JoinAttempts.size() < m_Points.size()) {
+                m_JoinAttempts.resize(m_Points.capacity());
+            }
+            uint16_t &attempts = m_JoinAttempts[parent];
+            if (attempts < UINT16_MAX) {
+                attempts++;
+            }
+            if (attempts < m_Stubbornness) {
+                return false;
+            }
+        }
+        return Random() <= m_Stickiness;
+    }
+
+    // PlaceParticle computes the final placement of the particle.
+    Vector PlaceParticle(const Vector &p, const int parent) const {
+        return LerpImage(m_Points[parent], p, m_ParticleSpacing);
+    }
+
+    // MotionVector returns a vector specifying the direction that the
+    // particle should move for one iteration. The distance that it will move
+    // is determined by the algorithm.
+    Vector MotionVector(const Vector &p) const {
+        if (m_BiasField) {
+            const Vector v = RandomInUnitSphere() + m_BiasField->At(p);
+            if (v.LengthSquared() > 1e-12) {
+                return v;
+            }
+        }
+        return RandomInUnitSphere();
+    }
+
+    // Parent returns the id of the particle that the specified particle joined
+    // to, or -1 for seed particles
+    int Parent(const int id) const {
+        return m_Parents[id];
+    }
+
+    // Depth returns the number of links between the specified particle and
+    // the seed at the root of its tree
+    int Depth(const int id) const {
+        return m_Depths[id];
+    }
+
+    // BranchOrder returns the Strahler number of the specified particle.
+    // Leaves have order 1 and the order only increases where two branches of
+    // equal order meet.
+    int BranchOrder(const int id) const {
+        return m_BranchOrders[id];
+    }
+
+    // SubtreeSize returns the number of particles in the subtree rooted at
+    // the specified particle, including the particle itself
+    int SubtreeSize(const int id) {
+        UpdateSubtreeSizes();
+        return m_SubtreeSizes[id];
+    }
+
+    // WriteTopology writes one line per particle with the columns
+    // id, parent_id, depth, subtree_size, branch_order
+    void WriteTopology(std::ostream &out) {
+        UpdateSubtreeSizes();
+        for (int id = 0; id < (int)m_Points.size(); id++) {
+            out
+                << id << "," << m_Parents[id] << ","
+                << m_Depths[id] << "," << m_SubtreeSizes[id] << ","
+                << (int)m_BranchOrders[id] << "\n";
+        }
+        out.flush();
+    }
+
+    // AddParticle diffuses one new particle and adds it to the model
+    void AddParticle() {
+        if (m_PerfCounters && m_PerfCounters->Sample()) {
+            AddParticleMeasured();
+            return;
+        }
+        Walker walker;
+        Launch(walker);
+        while (true) {
+            // get squared distance to nearest other particle
+            DistanceSquared d2;
+            const int parent = Nearest(walker.Position, d2);
+            if (Step(walker, parent, d2)) {
+                return;
+            }
+        }
+    }
+
+    // AddParticleMeasured is AddParticle with its phases attributed to
+    // m_PerfCounters. Launching counts as motion, and Add switches to the
+    // add phase itself.
+    void AddParticleMeasured() {
+        PerfCounters &perf = *m_PerfCounters;
+        perf.Switch(PerfPhaseMotion);
+        Walker walker;
+        Launch(walker);
+        while (true) {
+            perf.Switch(PerfPhaseQuery);
+            DistanceSquared d2;
+            const int parent = Nearest(walker.Position, d2);
+            perf.Switch(PerfPhaseMotion);
+            if (Step(walker, parent, d2)) {
+                break;
+            }
+        }
+        perf.Stop();
+    }
+
+    // AddParticles adds the specified number of particles like AddParticle,
+    // but interleaves the random walks of several walkers on the current
+    // thread. Their nearest neighbor searches take turns visiting one tree
+    // node each and prefetch the nodes they will visit next, so the cache
+    // misses of different walkers overlap instead of being waited for one
+    // after another. Particles are added as soon as they join and are seen
+    // by all walkers from then on, so growth follows the same rules as
+    // AddParticle, but the random numbers are consumed in a different order
+    // unless walkers is 1.
+    void AddParticles(
+        const int n, const int walkers = DefaultInterleavedWalkers)
+    {
+        std::vector<Walker> active(std::max(1, std::min(n, walkers)));
+        for (Walker &walker : active) {
+            Launch(walker);
+            StartSearch(walker);
+        }
+        int added = 0;
+        while (added < n) {
+            for (Walker &walker : active) {
+                KeyTree::Search &search = walker.Search;
+                const KeyTree &tree = walker.Frozen ? m_Frozen : m_Frontier;
+                if (!tree.Valid(search)) {
+                    StartSearch(walker);
+                    continue;
+                }
+                if (tree.Advance(search)) {
+                    continue;
+                }
+                if (!walker.Frozen) {
+                    // continue in the static tier within the distance found
+                    walker.Frozen = true;
+                    m_Frozen.Start(
+                        search, search.Target, search.Result, search.Distance);
+                    continue;
+                }
+
+                // the search is complete except for particles that were
+                // added since it started
+                int parent = search.Result;
+                DistanceSquared d2 = search.Distance;
+                const BoostPoint key = walker.Position.ToBoost();
+                for (int id = walker.Snapshot; id < Size(); id++) {
+                    const DistanceSquared d = KeyDistanceSquared(
+                        key, m_Points[id].ToBoost());
+                    if (d < d2) {
+                        d2 = d;
+                        parent = id;
+                    }
+                }
+                if (m_PeriodicWidth > 0) {
+                    parent = NearestImage(walker.Position, parent, d2);
+                }
+                if (Step(walker, parent, d2)) {
+                    if (++added == n) {
+                        break;
+                    }
+                    Launch(walker);
+                }
+                StartSearch(walker);
+            }
+        }
+    }
+
+    // AddParticleBallistic grows the cluster by one particle that travels in
+    // a straight line instead of a random walk. It is launched from outside
+    // the bounding sphere in a random direction, uniformly over the disk the
+    // sphere presents to that direction (in periodic mode it falls straight
+    // down from the launch plane), and joins the first particle whose
+    // attraction sphere it hits. Particles that miss, or are rejected by
+    // ShouldJoin, are relaunched.
+    void AddParticleBallistic() {
+        const double a = m_AttractionDistance;
+        const double segment = a * 2;
+        while (true) {
+            Vector p, direction;
+            BallisticLaunch(p, direction);
+            while (!BallisticEscaped(p, direction)) {
+                // far from everything: skip ahead to the nearest sphere
+                DistanceSquared d2;
+                Nearest(p, d2);
+                const double d =
+                    std::sqrt(d2 * (FixedPointUnit * FixedPointUnit));
+                if (d - a > segment) {
+                    p = Wrap(p + direction * (d - a));
+                    continue;
+                }
+
+                // close to the cluster: intersect the next segment of the
+                // ray exactly with the spheres around it
+                int parent;
+                double t;
+                if (!CastSegment(p, direction, segment, parent, t)) {
+                    p = Wrap(p + direction * segment);
+                    continue;
+                }
+                const Vector hit = Wrap(p + direction * t);
+                if (!ShouldJoin(hit, parent)) {
+                    break;
+                }
+                Add(PlaceParticle(hit, parent), parent);
+                return;
+            }
+        }
+    }
+
+    // AddParticleEden grows the cluster by one particle using the off-lattice
+    // Eden model. A particle is picked uniformly at random from the active
+    // set (particles that may still have room next to them) and the new
+    // particle is placed ParticleSpacing away from it in a random direction,
+    // as long as no other particle is closer than ParticleSpacing. Particles
+    // for which EdenAttempts directions in a row fail are considered enclosed
+    // and removed from the set, which is a vector with swap-removal so that
+    // selection and removal are O(1). Returns false once no active particles
+    // remain.
+    bool AddParticleEden() {
+        // particles added by any means since the last call become active
+        while (m_EdenSynced < (int)m_Points.size()) {
+            m_EdenActive.push_back(m_EdenSynced++);
+        }
+        const double clearance = m_ParticleSpacing * EdenClearance;
+        while (!m_EdenActive.empty()) {
+            const int active = m_EdenActive.size();
+            const int slot = std::min(active - 1, int(Random(0, active)));
+            const int parent = m_EdenActive[slot];
+            const Vector &q = m_Points[parent];
+            for (int i = 0; i < EdenAttempts; i++) {
+                const Vector p = Quantize(Wrap(
+                    q + RandomInUnitSphere().Normalized() * m_ParticleSpacing));
+                DistanceSquared d2;
+                Nearest(p, d2);
+                if (d2 * (FixedPointUnit * FixedPointUnit) >=
+                    clearance * clearance)
+                {
+                    Add(p, parent);
+                    return true;
+                }
+            }
+            m_EdenActive[slot] = m_EdenActive.back();
+            m_EdenActive.pop_back();
+        }
+        return false;
+    }
+
+    // AddParticleDBM grows the cluster by one particle using the dielectric
+    // breakdown model instead of a random walk. Returns false if the cluster
+    // can no longer grow because it has reached the edge of the grid.
+    bool AddParticleDBM() {
+        Vector p;
+        if (!m_Potential) {
+            return false;
+        }
+        m_Potential->Solve();
+        if (!m_Potential->ChooseGrowthSite(m_DBMEta, p)) {
+            return false;
+        }
+        const int parent = Nearest(p);
+        Add(p, parent);
+        return p.Length() + m_ParticleSpacing * 2 <
+            m_Potential->Radius();
+    }
+
+private:
+    // Walker is a particle on its random walk. The search state is only used
+    // by AddParticles.
+    struct Walker {
+        Vector Position;
+
+        // counters are accumulated per walker and published once it joins
+        uint64_t Steps;
+        uint64_t Resets;
+        uint64_t Rejections;
+
+        // the nearest neighbor search in progress, whether it has moved on
+        // to the static tier, and the number of particles when it started
+        KeyTree::Search Search;
+        bool Frozen;
+        int Snapshot;
+    };
+
+    // Launch starts a walker at a random starting position
+    void Launch(Walker &walker) const {
+        walker.Position = Quantize(RandomStartingPosition());
+        walker.Steps = 0;
+        walker.Resets = 0;
+        walker.Rejections = 0;
+    }
+
+    // StartSearch starts an interleaved nearest neighbor search from the
+    // walker's position in the frontier tier
+    void StartSearch(Walker &walker) const {
+        walker.Frozen = false;
+        walker.Snapshot = Size();
+        m_Frontier.Start(
+            walker.Search, ToKey(walker.Position.ToBoost()), -1,
+            std::numeric_limits<DistanceSquared>::max());
+    }
+
+    // Step takes one step of a walker's random walk given the nearest
+    // particle and the squared distance to it. It returns true if the walker
+    // joined the cluster and was added to the model.
+    bool Step(Walker &walker, const int parent, const DistanceSquared d2) {
+        Vector &p = walker.Position;
+        walker.Steps++;
+        if (walker.Steps % WalkStepsPublishInterval == 0) {
+            Increment(m_WalkSteps, WalkStepsPublishInterval);
+        }
+
+        // distances are compared squared, in index key units (which are
+        // integers in fixed-point mode)
+        const DistanceSquared attraction = ToCoordinate(m_AttractionDistance);
+        const DistanceSquared attractionSquared = attraction * attraction;
+
+        // check if close enough to join
+        if (d2 < attractionSquared) {
+            if (!ShouldJoin(p, parent)) {
+                // push particle away a bit
+                p = Quantize(LerpImage(m_Points[parent], p,
+                    m_AttractionDistance + m_MinMoveDistance));
+                walker.Rejections++;
+                return false;
+            }
+
+            // adjust particle position in relation to its parent
+            p = PlaceParticle(p, parent);
+
+            // publish the walk's counters before adding the point, so that
+            // its snapshot frame includes them
+            Increment(m_WalkSteps, walker.Steps % WalkStepsPublishInterval);
+            Increment(m_Resets, walker.Resets);
+            Increment(m_JoinRejections, walker.Rejections);
+            Add(p, parent);
+            return true;
+        }
+
+        // move randomly. walkers closer than minMoveLimit move the minimum
+        // distance, so the true distance is only needed (and only computed)
+        // beyond it
+        const double minMoveLimit = m_AttractionDistance + m_MinMoveDistance;
+        const double d2Units = d2 * (FixedPointUnit * FixedPointUnit);
+        double m = m_MinMoveDistance;
+        if (d2Units > minMoveLimit * minMoveLimit) {
+            m = std::sqrt(d2Units) - m_AttractionDistance;
+        }
+        const Vector v = MotionVector(p);
+        p = Quantize(Wrap(p + v * (m / std::sqrt(v.LengthSquared()))));
+
+        // check if particle is too far away, reset if so
+        if (ShouldReset(p)) {
+            p = Quantize(ResetPosition(p));
+            walker.Resets++;
+        }
+        return false;
+    }
+
+    // BallisticLaunch picks the starting point and direction of a ballistic
+    // particle
+    void BallisticLaunch(Vector &p, Vector &direction) const {
+        if (m_PeriodicWidth > 0) {
+            p = RandomStartingPosition();
+            direction = Vector(0, -1, 0);
+            return;
+        }
+        direction = RandomInUnitSphere().Normalized();
+        const double r = m_BoundingRadius;
+        Vector offset;
+        if (D == 2) {
+            offset = Vector(-direction.Y(), direction.X()) * Random(-r, r);
+        } else {
+            const Vector helper = std::abs(direction.X()) < 0.9 ?
+                Vector(1, 0, 0) : Vector(0, 1, 0);
+            const Vector u = direction.Cross(helper).Normalized();
+            const Vector w = direction.Cross(u);
+            while (true) {
+                const double x = Random(-1, 1);
+                const double y = Random(-1, 1);
+                if (x * x + y * y < 1) {
+                    offset = (u * x + w * y) * r;
+                    break;
+                }
+            }
+        }
+        p = offset - direction * r;
+    }
+
+    // BallisticEscaped returns true once a ballistic particle has passed the
+    // cluster without hitting it
+    bool BallisticEscaped(const Vector &p, const Vector &direction) const {
+        if (m_PeriodicWidth > 0) {
+            return p.Y() < m_MinHeight - m_AttractionDistance;
+        }
+        return p.Dot(direction) > m_BoundingRadius;
+    }
+
+    // CastSegment intersects the ray segment from p along direction (unit
+    // length) up to the specified length with the attraction spheres of all
+    // particles near it. It reports the first particle hit and the distance
+    // along the ray, or returns false if the segment is clear.
+    bool CastSegment(
+        const Vector &p, const Vector &direction, const double length,
+        int &parent, double &t) const
+    {
+        const double a = m_AttractionDistance;
+        const Vector q = p + direction * length;
+        const Vector lo(
+            std::min(p.X(), q.X()) - a,
+            std::min(p.Y(), q.Y()) - a,
+            std::min(p.Z(), q.Z()) - a);
+        const Vector hi(
+            std::max(p.X(), q.X()) + a,
+            std::max(p.Y(), q.Y()) + a,
+            std::max(p.Z(), q.Z()) + a);
+
+        parent = -1;
+        t = length;
+        const auto test = [&](const Vector &shift) {
+            const boost::geometry::model::box<BoostPoint> box(
+                (lo - shift).ToBoost(), (hi - shift).ToBoost());
+            const auto candidate = [&](const int id) {
+                const Vector oc = p - (m_Points[id] + shift);
+                const double b = oc.Dot(direction);
+                const double c = oc.LengthSquared() - a * a;
+                const double disc = b * b - c;
+                if (disc < 0) {
+                    return;
+                }
+                const double hit = c < 0 ? 0 : -b - std::sqrt(disc);
+                if (hit >= 0 && hit < t) {
+                    t = hit;
+                    parent = id;
+                }
+            };
+            const Key lo = ToKey(box.min_corner());
+            const Key hi = ToKey(box.max_corner());
+            m_Frozen.Query(lo, hi, candidate);
+            m_Frontier.Query(lo, hi, candidate);
+        };
+        test(Vector());
+
+        // in periodic mode, particles across a wall are tested as images
+        if (m_PeriodicWidth > 0) {
+            const double w = m_PeriodicWidth;
+            const double sx = lo.X() < 0 ? -w : (hi.X() > w ? w : 0);
+            const double sz = D == 2 ? 0 :
+                (lo.Z() < 0 ? -w : (hi.Z() > w ? w : 0));
+            if (sx != 0) {
+                test(Vector(sx, 0, 0));
+            }
+            if (sz != 0) {
+                test(Vector(0, 0, sz));
+            }
+            if (sx != 0 && sz != 0) {
+                test(Vector(sx, 0, sz));
+            }
+        }
+        return parent >= 0;
+    }
+
+    // Wrap maps a point into the periodic box. It returns the point unchanged
+    // when periodic mode is disabled.
+    Vector Wrap(const Vector &p) const {
+        if (m_PeriodicWidth <= 0) {
+            return p;
+        }
+        const double w = m_PeriodicWidth;
+        return Vector(
+            WrapCoordinate(p.X(), w),
+            p.Y(),
+            D == 2 ? 0 : WrapCoordinate(p.Z(), w));
+    }
+
+    // WrapCoordinate maps x into [0, w). Rounding can leave
+    // x - w * floor(x / w) slightly below 0 or at w (e.g. for tiny negative
+    // x), so both ends are fixed up.
+    static double WrapCoordinate(const double x, const double w) {
+        double r = x - w * std::floor(x / w);
+        if (r < 0) {
+            r += w;
+        }
+        if (r >= w) {
+            r -= w;
+        }
+        return r;
+    }
+
+    // LerpImage moves from a towards the nearest periodic image of b by
+    // distance, wrapping the result into the box. Same as Lerp when
+    // periodic mode is disabled.
+    Vector LerpImage(const Vector &a, const Vector &b, const double d) const {
+        if (m_PeriodicWidth <= 0) {
+            return Lerp(a, b, d);
+        }
+        const double w = m_PeriodicWidth;
+        const Vector v = b - a;
+        const Vector image(
+            v.X() - w * std::round(v.X() / w),
+            v.Y(),
+            D == 2 ? 0 : v.Z() - w * std::round(v.Z() / w));
+        return Wrap(a + image.Normalized() * d);
+    }
+
+    // NearestKey returns the particle whose index key is nearest the specified
+    // key if it is closer than distanceSquared, updating distanceSquared, and
+    // returns result otherwise. The small frontier tier is searched first so
+    // that the static tier only needs to be searched within the distance found
+    // there, which prunes most of its nodes.
+    int NearestKey(
+        const BoostPoint &key, int result,
+        DistanceSquared &distanceSquared) const
+    {
+        const Key k = ToKey(key);
+        result = m_Frontier.Nearest(k, result, distanceSquared);
+        return m_Frozen.Nearest(k, result, distanceSquared);
+    }
+
+    // Freeze bulk loads every particle, old and new, into the static tier of
+    // the index and empties the frontier tier. Both tiers are rebuilt from
+    // the start of the arena, so it never holds more than one generation of
+    // nodes.
+    void Freeze() {
+        std::vector<std::pair<Key, int>> values;
+        values.reserve(m_Points.size());
+        for (int i = 0; i < (int)m_Points.size(); i++) {
+            values.emplace_back(ToKey(m_Points[i].ToBoost()), i);
+        }
+        m_Frozen.Clear();
+        m_Frontier.Clear();
+        m_Arena.Reset();
+        m_Frozen.Build(std::move(values));
+        m_PublishedFrozenSize.store(m_Points.size(), std::memory_order_relaxed);
+        m_Frontier.Reserve(
+            m_Points.size() / (FrontierFraction - 1) + FrontierMinSize);
+    }
+
+    // NearestImage checks whether a particle across a periodic boundary is
+    // closer than the nearest one found directly. The index holds every
+    // particle once, so instead of duplicating particles near the edges, the
+    // query point is shifted by the box width. Shifted queries are only made
+    // when the nearest wall is closer than the current nearest particle,
+    // which is rare, so periodic queries cost about the same as unbounded
+    // ones.
+    int NearestImage(
+        const Vector &point, int result,
+        DistanceSquared &distanceSquared) const
+    {
+        const double w = m_PeriodicWidth;
+        const double sx = point.X() < w / 2 ? w : -w;
+        const double sz = point.Z() < w / 2 ? w : -w;
+        const DistanceSquared wx =
+            ToCoordinate(std::min(point.X(), w - point.X()));
+        const DistanceSquared wz =
+            ToCoordinate(std::min(point.Z(), w - point.Z()));
+        const bool nearX = wx * wx < distanceSquared;
+        const bool nearZ = D == 3 && wz * wz < distanceSquared;
+        const auto check = [&](const Vector &shift) {
+            result = NearestKey(
+                (point + shift).ToBoost(), result, distanceSquared);
+        };
+        if (nearX) {
+            check(Vector(sx, 0, 0));
+        }
+        if (nearZ) {
+            check(Vector(0, 0, sz));
+        }
+        if (nearX && nearZ) {
+            check(Vector(sx, 0, sz));
+        }
+        return result;
+    }
+
+    // UpdateLaunchSphere grows the tracked bounding box by a new particle and
+    // picks the smaller of two spheres that enclose all particles (plus the
+    // attraction distance): one centered on the origin and one centered on
+    // the bounding box
+    void UpdateLaunchSphere(const Vector &p) {
+        if (m_Points.size() == 1) {
+            m_BoundsMin = p;
+            m_BoundsMax = p;
+        } else {
+            m_BoundsMin = Vector(
+                std::min(m_BoundsMin.X(), p.X()),
+                std::min(m_BoundsMin.Y(), p.Y()),
+                std::min(m_BoundsMin.Z(), p.Z()));
+            m_BoundsMax = Vector(
+                std::max(m_BoundsMax.X(), p.X()),
+                std::max(m_BoundsMax.Y(), p.Y()),
+                std::max(m_BoundsMax.Z(), p.Z()));
+        }
+        const double boxRadius =
+            (m_BoundsMax - m_BoundsMin).Length() / 2 + m_AttractionDistance;
+        if (boxRadius < m_BoundingRadius) {
+            m_LaunchCenter = (m_BoundsMin + m_BoundsMax) * 0.5;
+            m_LaunchRadius = boxRadius;
+        } else {
+            m_LaunchCenter = Vector();
+            m_LaunchRadius = m_BoundingRadius;
+        }
+    }
+
+    // Increment adds to a counter that is only written by the thread growing
+    // the model, which does not need an atomic read-modify-write
+    static void Increment(std::atomic<uint64_t> &counter, const uint64_t n) {
+        counter.store(
+            counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+
+    // AddToTree records the parent link of a newly added particle and updates
+    // the incrementally maintained topology metrics
+    void AddToTree(const int id, const int parent) {
+        m_Parents.push_back(parent);
+        m_Depths.push_back(parent < 0 ? 0 : m_Depths[parent] + 1);
+        m_BranchOrders.push_back(1);
+        m_MaxChildOrders.push_back(0);
+        m_MaxChildCounts.push_back(0);
+
+        // propagate the new leaf's order towards the root. a child's order
+        // only ever increases, so we can stop as soon as a parent's order is
+        // unchanged, which keeps the amortized cost small.
+        int child = id;
+        int node = parent;
+        while (node >= 0) {
+            const uint8_t order = m_BranchOrders[child];
+            if (order > m_MaxChildOrders[node]) {
+                m_MaxChildOrders[node] = order;
+                m_MaxChildCounts[node] = 1;
+            } else if (order == m_MaxChildOrders[node]) {
+                m_MaxChildCounts[node] = 2;
+            } else {
+                break;
+            }
+            const uint8_t newOrder = m_MaxChildCounts[node] > 1 ?
+                m_MaxChildOrders[node] + 1 : m_MaxChildOrders[node];
+            if (newOrder <= m_BranchOrders[node]) {
+                break;
+            }
+            m_BranchOrders[node] = newOrder;
+            child = node;
+            node = m_Parents[node];
+        }
+    }
+
+    // UpdateSubtreeSizes brings m_SubtreeSizes up to date. Parents always have
+    // a lower id than their children, so one reverse sweep suffices. This is
+    // done lazily because walking all ancestors on every Add would cost
+    // O(depth) per particle.
+    void UpdateSubtreeSizes() {
+        const int n = m_Points.size();
+        if ((int)m_SubtreeSizes.size() == n) {
+            return;
+        }
+        m_SubtreeSizes.assign(n, 1);
+        for (int id = n - 1; id >= 0; id--) {
+            const int parent = m_Parents[id];
+            if (parent >= 0) {
+                m_SubtreeSizes[parent] += m_SubtreeSizes[id];
+            }
+        }
+    }
+
+    // m_ParticleSpacing defines the distance between particles that are
+    // joined together
+    double m_ParticleSpacing;
+
+    // m_AttractionDistance defines how close together particles must be in
+    // order to join together
+    double m_AttractionDistance;
+
+    // m_MinMoveDistance defines the minimum distance that a particle will move
+    // during its random walk
+    double m_MinMoveDistance;
+
+    // m_Stubbornness defines how many interactions must occur before a
+    // particle will allow another particle to join to it.
+    int m_Stubbornness;
+
+    // m_Stickiness defines the probability that a particle will allow another
+    // particle to join to it.
+    double m_Stickiness;
+
+    // m_BoundingRadius defines the radius of the bounding sphere that bounds
+    // all of the particles
+    double m_BoundingRadius;
+
+    // m_PeriodicWidth defines the width of the periodic box, or 0 for
+    // unbounded growth
+    double m_PeriodicWidth;
+
+    // m_MinHeight and m_MaxHeight define the extent of the particles along
+    // the y axis, which is the growth direction in periodic mode
+    double m_MinHeight;
+    double m_MaxHeight;
+
+    // m_AdaptiveLaunch enables the tighter launch sphere and exact walker
+    // returns described in SetAdaptiveLaunch
+    bool m_AdaptiveLaunch;
+
+    // m_BoundsMin and m_BoundsMax define the bounding box of all particles
+    Vector m_BoundsMin;
+    Vector m_BoundsMax;
+
+    // m_LaunchCenter and m_LaunchRadius define the launch sphere used when
+    // m_AdaptiveLaunch is enabled
+    Vector m_LaunchCenter;
+    double m_LaunchRadius;
+
+    // counters published for other threads (see ParticleCount and friends)
+    std::atomic<uint64_t> m_ParticleCount;
+    std::atomic<uint64_t> m_WalkSteps;
+    std::atomic<uint64_t> m_Resets;
+    std::atomic<uint64_t> m_JoinRejections;
+    std::atomic<double> m_PublishedBoundingRadius;
+    std::atomic<uint64_t> m_PublishedFrozenSize;
+
+    // m_Output is the stream that particles are written to, if any
+    std::ostream *m_Output;
+
+    // m_DeltaWriter writes the compact output format, if enabled
+    std::unique_ptr<DeltaWriter> m_DeltaWriter;
+
+    // m_SnapshotWriter writes animation frames, if enabled
+    std::unique_ptr<SnapshotWriter> m_SnapshotWriter;
+
+    // m_Log receives every particle added, if set
+    ParticleLog *m_Log;
+
+    // m_PerfCounters measures the phases of AddParticle, if set
+    PerfCounters *m_PerfCounters;
+
+    // m_BiasField is an optional drift field applied in MotionVector
+    const BiasField *m_BiasField;
+
+    // m_Potential is the potential grid used by AddParticleDBM, if enabled
+    std::unique_ptr<PotentialGrid> m_Potential;
+
+    // m_DBMEta is the exponent applied to the potential for DBM growth
+    double m_DBMEta;
+
+    // m_EdenActive lists the particles that may still have room for a
+    // neighbor in Eden mode, and m_EdenSynced counts the particles that have
+    // been considered for it
+    std::vector<int> m_EdenActive;
+    int m_EdenSynced;
+
+    // m_Points stores the final particle positions
+    std::vector<Vector> m_Points;
+
+    // m_JoinAttempts stores the number of times other particles have
+    // attempted to join with each particle. It is only allocated and
+    // maintained when m_Stubbornness is non-zero, and may be longer than
+    // m_Points.
+    std::vector<uint16_t> m_JoinAttempts;
+
+    // m_Parents stores the id of the particle each particle joined to
+    std::vector<int> m_Parents;
+
+    // m_Depths stores the distance (in links) from each particle to its root
+    std::vector<int> m_Depths;
+
+    // m_BranchOrders stores the Strahler number of each particle
+    std::vector<uint8_t> m_BranchOrders;
+
+    // m_MaxChildOrders and m_MaxChildCounts store the highest branch order
+    // among each particle's children and whether it occurs once or more than
+    // once (saturating at 2), which is all that is needed to derive the
+    // particle's own branch order
+    std::vector<uint8_t> m_MaxChildOrders;
+    std::vector<uint8_t> m_MaxChildCounts;
+
+    // m_SubtreeSizes caches the number of particles in each subtree. It is
+    // recomputed on demand when particles have been added since.
+    std::vector<int> m_SubtreeSizes;
+
+    // m_Arena provides the memory for the spatial index nodes. It must be
+    // declared before the index so that it outlives it.
+    Arena m_Arena;
+
+    // the spatial index used to accelerate nearest neighbor queries has two
+    // tiers: m_Frozen is a tree bulk loaded with the particles present at the
+    // last freeze, and m_Frontier holds the particles added since
+    KeyTree m_Frozen;
+    KeyTree m_Frontier;
+};
+
+// ReadSysfsList reads a sysfs list file like "0-3,8-11" and returns the
+// numbers it lists, or nothing if the file cannot be read
+std::vector<int> ReadSysfsList(const std::string &path) {
+    std::vector<int> result;
+    std::ifstream in(path);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        int lo, hi;
+        const int n = std::sscanf(range.c_str(), "%d-%d", &lo, &hi);
+        if (n < 1 || lo < 0) {
+            continue;
+        }
+        for (int i = lo; i <= (n == 2 ? hi : lo); i++) {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+// NumaNodes returns the CPUs belonging to each online NUMA node, as listed
+// in sysfs. Node numbers can be sparse (e.g. "0,2"), so the online list is
+// read rather than probing nodes from 0 up. Systems without NUMA information
+// are reported as a single node with all CPUs.
+std::vector<std::vector<int>> NumaNodes() {
+    std::vector<std::vector<int>> nodes;
+    const std::string root = "/sys/devices/system/node/";
+    for (const int node : ReadSysfsList(root + "online")) {
+        std::vector<int> cpus = ReadSysfsList(
+            root + "node" + std::to_string(node) + "/cpulist");
+        if (!cpus.empty()) {
+            nodes.push_back(std::move(cpus));
+        }
+    }
+    if (nodes.empty()) {
+        const int n = std::thread::hardware_concurrency();
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < n; cpu++) {
+            nodes.back().push_back(cpu);
+        }
+    }
+    return nodes;
+}
+
+// PinCurrentThread restricts the calling thread to the specified CPUs.
+// Memory is allocated on the node of the thread that first touches it, so a
+// thread pinned to a node keeps the models it builds in local memory.
+// The CPU set is allocated to fit the highest CPU number, which can exceed
+// CPU_SETSIZE on large machines.
+bool PinCurrentThread(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    const int count = *std::max_element(cpus.begin(), cpus.end()) + 1;
+    cpu_set_t *set = CPU_ALLOC(count);
+    if (!set) {
+        return false;
+    }
+    const size_t size = CPU_ALLOC_SIZE(count);
+    CPU_ZERO_S(size, set);
+    for (const int cpu : cpus) {
+        CPU_SET_S(cpu, size, set);
+    }
+    const bool ok = pthread_setaffinity_np(pthread_self(), size, set) == 0;
+    CPU_FREE(set);
+    return ok;
+}
+
+// RunStats summarizes one run of an ensemble
+struct RunStats {
+    int Run;
+    int Node;
+    unsigned int Seed;
+    int Particles;
+    double BoundingRadius;
+    double RadiusOfGyration;
+    int MaxDepth;
+    double Seconds;
+};
+
+// RunEnsemble grows the specified number of independent models, each to the
+// specified number of particles, concurrently on a pool of threads. Each run
+// uses its own random stream seeded from baseSeed + run, so results do not
+// depend on scheduling. The configure function is called for every model
+// before it is grown to set parameters and add seed particles. Particle
+// output is disabled; per-run statistics are collected in memory instead.
+//
+// On multi-socket machines the threads are spread round-robin over the NUMA
+// nodes and pinned to them. Every model is created and grown by one worker,
+// so its particles and index are first-touched, and therefore placed, in
+// that worker's local memory. A positive maxNodes uses only the first
+// maxNodes nodes.
+std::vector<RunStats> RunEnsemble(
+    const int runs, const int particles, const unsigned int baseSeed,
+    const std::function<void(Model &)> &configure,
+    int threads = std::thread::hardware_concurrency(),
+    const int maxNodes = 0)
+{
+    std::vector<RunStats> results(runs);
+    std::atomic<int> next(0);
+    threads = std::max(1, std::min(threads, runs));
+    std::vector<std::vector<int>> nodes = NumaNodes();
+    const bool pin = nodes.size() > 1;
+    if (maxNodes > 0 && nodes.size() > size_t(maxNodes)) {
+        nodes.resize(maxNodes);
+    }
+
+    const auto worker = [&](const int node) {
+        if (pin) {
+            PinCurrentThread(nodes[node]);
+        }
+        while (true) {
+            const int run = next++;
+            if (run >= runs) {
+                return;
+            }
+            const unsigned int seed = baseSeed + run;
+            SeedRandom(seed);
+
+            const auto start = std::chrono::steady_clock::now();
+            Model model;
+            model.SetOutput(nullptr);
+            model.Reserve(particles);
+            configure(model);
+            while (model.Size() < particles) {
+                model.AddParticle();
+            }
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+            // radius of gyration about the center of mass
+            const int n = model.Size();
+            Vector center;
+            for (int id = 0; id < n; id++) {
+                center += model.Position(id);
+            }
+            center = center * (1.0 / n);
+            double sum = 0;
+            int maxDepth = 0;
+            for (int id = 0; id < n; id++) {
+                sum += (model.Position(id) - center).LengthSquared();
+                maxDepth = std::max(maxDepth, model.Depth(id));
+            }
+
+            RunStats &stats = results[run];
+            stats.Run = run;
+            stats.Node = node;
+            stats.Seed = seed;
+            stats.Particles = n;
+            stats.BoundingRadius = model.BoundingRadius();
+            stats.RadiusOfGyration = std::sqrt(sum / n);
+            stats.MaxDepth = maxDepth;
+            stats.Seconds = elapsed.count();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++) {
+        pool.emplace_back(worker, i % nodes.size());
+    }
+    for (auto &thread : pool) {
+        thread.join();
+    }
+    return results;
+}
+
+// WriteEnsembleStats writes one line per run with the columns
+// run, seed, particles, bounding_radius, radius_of_gyration, max_depth,
+// seconds, node
+void WriteEnsembleStats(
+    std::ostream &out, const std::vector<RunStats> &results)
+{
+    for (const RunStats &stats : results) {
+        out
+            << stats.Run << "," << stats.Seed << "," << stats.Particles << ","
+            << stats.BoundingRadius << "," << stats.RadiusOfGyration << ","
+            << stats.MaxDepth << "," << stats.Seconds << ","
+            << stats.Node << "\n";
+    }
+    out.flush();
+}
+
+// BenchmarkNumaScaling measures ensemble throughput when using the first
+// 1, 2, ... NUMA nodes with one thread per CPU of the nodes used, and writes
+// one line per node count with the columns nodes, threads, seconds,
+// particles_per_second. With local memory placement, throughput should grow
+// in proportion to the number of nodes.
+void BenchmarkNumaScaling(
+    std::ostream &out, const int runsPerThread, const int particles)
+{
+    const std::vector<std::vector<int>> nodes = NumaNodes();
+    int threads = 0;
+    for (size_t used = 1; used <= nodes.size(); used++) {
+        threads += nodes[used - 1].size();
+        const int runs = runsPerThread * threads;
+        const auto start = std::chrono::steady_clock::now();
+        RunEnsemble(runs, particles, 1, [](Model &m) {
+            m.Add(Vector());
+        }, threads, used);
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        out
+            << used << "," << threads << "," << elapsed.count() << ","
+            << double(runs) * particles / elapsed.count() << std::endl;
+    }
+}
+
+#ifdef DLAF_MPI
+
+// DistributedModel grows one cluster across the ranks of an MPI
+// communicator. Space is split around the origin into equal wedges of
+// azimuth (about the z axis in 2D and the y axis in 3D), one per rank. Each
+// rank keeps a local Model holding only the particles within the halo width
+// of its wedge. Walkers step at most as far as the halo guarantees is empty,
+// and move to the rank that owns the wedge they enter.
+//
+// Growth proceeds in rounds. In each round every rank advances its walkers,
+// and then new particles are given global ids and sent to the ranks whose
+// halos they fall in, together with walkers that changed wedges. Ranks see
+// particles added by other ranks in the same round only from the next round
+// on. Two particles placed in the same round can only come too close if
+// they are placed near a wedge boundary, so joins there are held until the
+// end of the round. The held joins of all ranks are then gathered, and each
+// is only made if no particle placed in that round, including the held joins
+// before it in rank order, is closer than the particle spacing. Otherwise
+// its walker is pushed away and carries on in the next round. Every wedge
+// meets the axis, so particles near the axis are in every rank's halo and
+// every join there is held.
+//
+// Periodic mode, the alternative growth engines and the particle log are
+// not supported here. Join attempt counts are kept per rank.
+class DistributedModel {
+public:
+    explicit DistributedModel(MPI_Comm comm) :
+        m_Comm(comm),
+        m_HaloWidth(DefaultHaloWidth),
+        m_Walkers(DefaultDistributedWalkers),
+        m_StepsPerRound(DefaultStepsPerRound),
+        m_BoundingRadius(0),
+        m_Size(0),
+        m_WalkSteps(0),
+        m_Output(&std::cout),
+        m_Launched(false)
+    {
+        MPI_Comm_rank(comm, &m_Rank);
+        MPI_Comm_size(comm, &m_Ranks);
+        m_Local.SetOutput(nullptr);
+    }
+
+    // Local returns the rank's local model, which is where the growth
+    // parameters (AttractionDistance, Stickiness, ...) and hooks apply
+    Model &Local() {
+        return m_Local;
+    }
+
+    // SetHaloWidth sets how far beyond its wedge a rank keeps copies of
+    // particles. Walkers never step further than this in one go near a
+    // wedge boundary, so it must exceed AttractionDistance + MinMoveDistance;
+    // wider halos allow longer steps at the cost of more copies.
+    void SetHaloWidth(const double w) {
+        m_HaloWidth = w;
+    }
+
+    // SetWalkers sets the number of walkers each rank launches at the start
+    void SetWalkers(const int n) {
+        m_Walkers = n;
+    }
+
+    // SetStepsPerRound sets how many steps each walker takes between
+    // exchanges. Shorter rounds make particles visible to other ranks
+    // sooner but communicate more often.
+    void SetStepsPerRound(const int n) {
+        m_StepsPerRound = n;
+    }
+
+    // SetOutput sets the stream this rank writes the particles it creates
+    // to, in the usual CSV format with global ids
+    void SetOutput(std::ostream *output) {
+        m_Output = output;
+    }
+
+    // Size returns the number of particles in the whole cluster
+    int64_t Size() const {
+        return m_Size;
+    }
+
+    // WalkSteps returns the total number of walk steps on all ranks. It must
+    // be called on all ranks.
+    uint64_t WalkSteps() const {
+        uint64_t total = 0;
+        MPI_Allreduce(
+            &m_WalkSteps, &total, 1, MPI_UINT64_T, MPI_SUM, m_Comm);
+        return total;
+    }
+
+    // Add adds a seed particle. It must be called on all ranks with the
+    // same point; rank 0 writes it to its output.
+    void Add(const Vector &point) {
+        const int64_t id = m_Size++;
+        if (m_Rank == 0 && m_Output) {
+            *m_Output
+                << id << "," << -1 << ","
+                << point.X() << "," << point.Y() << "," << point.Z()
+                << std::endl;
+        }
+        m_BoundingRadius = std::max(
+            m_BoundingRadius,
+            point.Length() + m_Local.AttractionDistance());
+        if (WedgeDistance(m_Rank, point) <= m_HaloWidth) {
+            m_Local.Add(point);
+            m_GlobalIds.push_back(id);
+        }
+    }
+
+    // Grow adds the specified number of particles to the cluster. It must
+    // be called on all ranks.
+    void Grow(const int64_t particles) {
+        const int64_t target = m_Size + particles;
+        while (m_Size < target) {
+            // spread what is left evenly so the total comes out exact, and
+            // limit how much the cluster grows per round, as ranks do not
+            // see each other's new particles until the round is over
+            const int64_t remaining = target - m_Size;
+            const int64_t quota =
+                remaining / m_Ranks + (m_Rank < remaining % m_Ranks);
+            const int64_t limit = m_Size * MaxRoundGrowth / m_Ranks;
+            Round(std::min(quota, std::max<int64_t>(1, limit)));
+        }
+    }
+
+private:
+    // Particle is a new particle sent to the ranks whose halo it is in
+    struct Particle {
+        int64_t ID;
+        double X, Y, Z;
+    };
+
+    // Walker is the position of a walker moving to another rank, or of a
+    // held join
+    struct Walker {
+        double X, Y, Z;
+    };
+
+    // PendingJoin is a join held until the end of the round: the walker's
+    // position, the particle's placement and its local parent
+    struct PendingJoin {
+        Vector From;
+        Vector Position;
+        int Parent;
+    };
+
+    // Azimuth returns the angle of a point around the axis that the wedges
+    // share, in [0, 2 pi)
+    static double Azimuth(const Vector &p) {
+        const double a = D == 2 ?
+            std::atan2(p.Y(), p.X()) : std::atan2(p.Z(), p.X());
+        return a < 0 ? a + 2 * M_PI : a;
+    }
+
+    // Owner returns the rank whose wedge contains the point
+    int Owner(const Vector &p) const {
+        const int r = Azimuth(p) / (2 * M_PI) * m_Ranks;
+        return std::min(r, m_Ranks - 1);
+    }
+
+    // RayDistance returns the distance from a point to the half-plane that
+    // contains the wedge axis and leaves it at the specified angle
+    static double RayDistance(const Vector &p, const double angle) {
+        const double u = std::cos(angle);
+        const double v = std::sin(angle);
+        const double x = p.X();
+        const double y = D == 2 ? p.Y() : p.Z();
+        if (x * u + y * v <= 0) {
+            return std::sqrt(x * x + y * y);
+        }
+        return std::abs(x * v - y * u);
+    }
+
+    // WedgeDistance returns the distance from a point to the wedge of the
+    // specified rank, which is 0 inside it
+    double WedgeDistance(const int rank, const Vector &p) const {
+        if (m_Ranks == 1 || Owner(p) == rank) {
+            return 0;
+        }
+        const double a0 = 2 * M_PI * rank / m_Ranks;
+        const double a1 = 2 * M_PI * (rank + 1) / m_Ranks;
+        return std::min(RayDistance(p, a0), RayDistance(p, a1));
+    }
+
+    // Clearance returns how far a walker in this rank's wedge can be sure
+    // that its local model knows every particle. A particle that is not in
+    // the halo is more than the halo width away from the wedge, and the
+    // wedge is convex, so the way to it leaves the wedge first. Nothing is
+    // outside the bounding sphere either.
+    double Clearance(const Vector &p) const {
+        const double a0 = 2 * M_PI * m_Rank / m_Ranks;
+        const double a1 = 2 * M_PI * (m_Rank + 1) / m_Ranks;
+        const double edge = std::min(RayDistance(p, a0), RayDistance(p, a1));
+        const double outside =
+            p.Length() - (m_BoundingRadius - m_Local.AttractionDistance());
+        return std::max(edge + m_HaloWidth, outside);
+    }
+
+    // Launch returns a uniformly random point on the launch sphere with an
+    // azimuth between a0 and a1. The azimuth of a uniformly random point on
+    // a sphere is uniform, so it is simply drawn from that range.
+    Vector Launch(const double a0 = 0, const double a1 = 2 * M_PI) const {
+        const double a = Random(a0, a1);
+        const double r = m_BoundingRadius;
+        if (D == 2) {
+            return Quantize(Vector(std::cos(a), std::sin(a)) * r);
+        }
+        const double y = Random(-1, 1);
+        const double s = std::sqrt(1 - y * y);
+        return Quantize(Vector(std::cos(a) * s, y, std::sin(a) * s) * r);
+    }
+
+    // JoinMargin returns how close to another wedge a walker must be for its
+    // join to be held until the end of the round. A particle is placed
+    // within AttractionDistance + ParticleSpacing of its walker, so
+    // particles placed further than this from other wedges are more than the
+    // particle spacing away from anything placed by other ranks.
+    double JoinMargin() const {
+        const double s = m_Local.ParticleSpacing();
+        return s + 2 * (m_Local.AttractionDistance() + s);
+    }
+
+    // NearOtherWedge returns true if the point is within JoinMargin of a
+    // wedge other than this rank's
+    bool NearOtherWedge(const Vector &p) const {
+        const double margin = JoinMargin();
+        for (int r = 0; r < m_Ranks; r++) {
+            if (r != m_Rank && WedgeDistance(r, p) < margin) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Walk advances a walker by up to m_StepsPerRound steps, adding a
+    // particle whenever it joins and relaunching it instead once the quota
+    // is used up. Returns false if the walker left the wedge, or if it
+    // joined near another wedge, in which case the join is held in
+    // m_Pending. Walkers that join or go too far away are replaced by a new
+    // walker anywhere on the launch sphere, which may be in another wedge,
+    // so that walkers arrive uniformly from all directions no matter where
+    // the cluster grows.
+    bool Walk(Vector &p, int64_t &quota) {
+        const double a = m_Local.AttractionDistance();
+        const double minMove = m_Local.MinMoveDistance();
+        const DistanceSquared attraction = ToCoordinate(a);
+        const DistanceSquared attractionSquared = attraction * attraction;
+        const DistanceSquared spacing = ToCoordinate(
+            m_Local.ParticleSpacing());
+        const DistanceSquared spacingSquared = spacing * spacing;
+        for (int i = 0; i < m_StepsPerRound; i++) {
+            if (Owner(p) != m_Rank) {
+                return false;
+            }
+            m_WalkSteps++;
+
+            // the local model may not know particles beyond the clearance
+            DistanceSquared d2;
+            const int parent = m_Local.Nearest(p, d2);
+            if (m_Ranks > 1) {
+                const double clearance = Clearance(p) / FixedPointUnit;
+                d2 = std::min(d2, (DistanceSquared)(clearance * clearance));
+            }
+
+            if (d2 < attractionSquared && parent >= 0) {
+                // walkers must keep moving when the quota has run out, so
+                // that one reaches a rank that still has some
+                if (quota == 0) {
+                    p = Launch();
+                    continue;
+                }
+                // walkers wait for their turn where they are, and a
+                // particle placed right next to one in the meantime would
+                // put its own particle on the far side of its parent, too
+                // close to others. Such walkers are pushed away instead.
+                if (d2 < spacingSquared || !m_Local.ShouldJoin(p, parent)) {
+                    p = Quantize(Lerp(
+                        m_Local.Position(parent), p, a + minMove));
+                    continue;
+                }
+                const Vector q = m_Local.PlaceParticle(p, parent);
+                quota--;
+                if (m_Ranks > 1 && NearOtherWedge(p)) {
+                    m_Pending.push_back(PendingJoin{p, q, parent});
+                    return false;
+                }
+                Commit(q, parent);
+                p = Launch();
+                continue;
+            }
+
+            const double d2Units = d2 * (FixedPointUnit * FixedPointUnit);
+            double m = minMove;
+            if (d2Units > (a + minMove) * (a + minMove)) {
+                m = std::sqrt(d2Units) - a;
+            }
+            const Vector v = m_Local.MotionVector(p);
+            p = Quantize(p + v * (m / std::sqrt(v.LengthSquared())));
+            const double kill = m_BoundingRadius * 2;
+            if (p.LengthSquared() > kill * kill) {
+                p = Launch();
+            }
+        }
+        return true;
     }
 
-    // MotionVector returns a vector specifying the direction that the
-    // particle should move for one iteration. The distance that it will move
-    // is determined by the algorithm.
-    Vector MotionVector(const Vector &p) const {
-        return RandomInUnitSphere();
+    // Commit adds a particle placed by this rank to the local model. It is
+    // given a global id and sent to other ranks by Publish.
+    void Commit(const Vector &q, const int parent) {
+        m_New.emplace_back(m_Local.Size(), parent);
+        m_Local.Add(q, parent);
+        m_GlobalIds.push_back(-1);
+        m_BoundingRadius = std::max(
+            m_BoundingRadius, q.Length() + m_Local.AttractionDistance());
     }
 
-    // AddParticle diffuses one new particle and adds it to the model
-    void AddParticle() {
-        // compute particle starting location
-        Vector p = RandomStartingPosition();
+    // ChunkItems returns how many items of the specified size a rank sends
+    // to each rank per collective call, so that the call moves at most
+    // MPIChunkBytes
+    uint64_t ChunkItems(const size_t size) const {
+        return std::max<uint64_t>(1, MPIChunkBytes / size / m_Ranks);
+    }
 
-        // do the random walk
-        while (true) {
-            // get distance to nearest other particle
-            const int parent = Nearest(p);
-            const double d = p.Distance(m_Points[parent]);
-
-            // check if close enough to join
-            if (d < m_AttractionDistance) {
-                if (!ShouldJoin(p, parent)) {
-                    // push particle away a bit
-                    p = Lerp(m_Points[parent], p,
-                        m_AttractionDistance + m_MinMoveDistance);
+    // ToCount converts a byte count or displacement for an MPI call, which
+    // must fit in an int. Throws std::overflow_error if it does not.
+    static int ToCount(const uint64_t bytes) {
+        if (bytes > (uint64_t)std::numeric_limits<int>::max()) {
+            throw std::overflow_error("DistributedModel: MPI count overflow");
+        }
+        return bytes;
+    }
+
+    // Exchange sends every rank its list of items and returns the items
+    // received from all ranks, in rank order. The items are sent in rounds
+    // of at most ChunkItems per pair of ranks.
+    template <typename T>
+    std::vector<T> Exchange(const std::vector<std::vector<T>> &outgoing) {
+        std::vector<uint64_t> sendCounts(m_Ranks), recvCounts(m_Ranks);
+        for (int r = 0; r < m_Ranks; r++) {
+            sendCounts[r] = outgoing[r].size();
+        }
+        MPI_Alltoall(
+            sendCounts.data(), 1, MPI_UINT64_T,
+            recvCounts.data(), 1, MPI_UINT64_T, m_Comm);
+        const uint64_t chunk = ChunkItems(sizeof(T));
+        uint64_t rounds = 0;
+        for (int r = 0; r < m_Ranks; r++) {
+            rounds = std::max(rounds, (sendCounts[r] + chunk - 1) / chunk);
+        }
+        MPI_Allreduce(
+            MPI_IN_PLACE, &rounds, 1, MPI_UINT64_T, MPI_MAX, m_Comm);
+
+        std::vector<std::vector<T>> incoming(m_Ranks);
+        std::vector<int> sendBytes(m_Ranks), recvBytes(m_Ranks);
+        std::vector<int> sendOffsets(m_Ranks), recvOffsets(m_Ranks);
+        std::vector<T> send, recv;
+        for (uint64_t round = 0; round < rounds; round++) {
+            const uint64_t begin = round * chunk;
+            uint64_t sendTotal = 0, recvTotal = 0;
+            send.clear();
+            for (int r = 0; r < m_Ranks; r++) {
+                const uint64_t s = Slice(sendCounts[r], begin, chunk);
+                send.insert(
+                    send.end(), outgoing[r].begin() + begin,
+                    outgoing[r].begin() + begin + s);
+                sendOffsets[r] = ToCount(sendTotal);
+                sendBytes[r] = ToCount(s * sizeof(T));
+                sendTotal += s * sizeof(T);
+                const uint64_t n = Slice(recvCounts[r], begin, chunk);
+                recvOffsets[r] = ToCount(recvTotal);
+                recvBytes[r] = ToCount(n * sizeof(T));
+                recvTotal += n * sizeof(T);
+            }
+            recv.resize(recvTotal / sizeof(T));
+            MPI_Alltoallv(
+                send.data(), sendBytes.data(), sendOffsets.data(), MPI_BYTE,
+                recv.data(), recvBytes.data(), recvOffsets.data(), MPI_BYTE,
+                m_Comm);
+            for (int r = 0; r < m_Ranks; r++) {
+                const auto it = recv.begin() + recvOffsets[r] / sizeof(T);
+                incoming[r].insert(
+                    incoming[r].end(), it, it + recvBytes[r] / sizeof(T));
+            }
+        }
+        return Concatenate(incoming);
+    }
+
+    // Gather returns the items of all ranks in rank order, and stores the
+    // index of this rank's first item. The items are sent in rounds of at
+    // most ChunkItems per rank.
+    template <typename T>
+    std::vector<T> Gather(const std::vector<T> &items, uint64_t &first) {
+        const uint64_t count = items.size();
+        std::vector<uint64_t> counts(m_Ranks);
+        MPI_Allgather(
+            &count, 1, MPI_UINT64_T, counts.data(), 1, MPI_UINT64_T, m_Comm);
+        first = 0;
+        for (int r = 0; r < m_Rank; r++) {
+            first += counts[r];
+        }
+        const uint64_t chunk = ChunkItems(sizeof(T));
+        const uint64_t largest =
+            *std::max_element(counts.begin(), counts.end());
+        const uint64_t rounds = (largest + chunk - 1) / chunk;
+
+        std::vector<std::vector<T>> incoming(m_Ranks);
+        std::vector<int> bytes(m_Ranks), offsets(m_Ranks);
+        std::vector<T> recv;
+        for (uint64_t round = 0; round < rounds; round++) {
+            const uint64_t begin = round * chunk;
+            uint64_t total = 0;
+            for (int r = 0; r < m_Ranks; r++) {
+                const uint64_t n = Slice(counts[r], begin, chunk);
+                offsets[r] = ToCount(total);
+                bytes[r] = ToCount(n * sizeof(T));
+                total += n * sizeof(T);
+            }
+            recv.resize(total / sizeof(T));
+            MPI_Allgatherv(
+                items.data() + std::min(begin, count), bytes[m_Rank],
+                MPI_BYTE, recv.data(), bytes.data(), offsets.data(), MPI_BYTE,
+                m_Comm);
+            for (int r = 0; r < m_Ranks; r++) {
+                const auto it = recv.begin() + offsets[r] / sizeof(T);
+                incoming[r].insert(
+                    incoming[r].end(), it, it + bytes[r] / sizeof(T));
+            }
+        }
+        return Concatenate(incoming);
+    }
+
+    // Slice returns how many of count items are sent in the round that
+    // starts at item begin
+    static uint64_t Slice(
+        const uint64_t count, const uint64_t begin, const uint64_t chunk)
+    {
+        return begin < count ? std::min(chunk, count - begin) : 0;
+    }
+
+    template <typename T>
+    static std::vector<T> Concatenate(const std::vector<std::vector<T>> &v) {
+        std::vector<T> result;
+        for (const std::vector<T> &items : v) {
+            result.insert(result.end(), items.begin(), items.end());
+        }
+        return result;
+    }
+
+    // Publish numbers the particles this rank added since the last call
+    // after those of lower ranks, writes them, and sends them to the ranks
+    // whose halo they are in. Returns the largest distance of a new particle
+    // from the origin. It must be called on all ranks.
+    double Publish() {
+        const int count = m_New.size();
+        std::vector<int> counts(m_Ranks);
+        MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, m_Comm);
+        int64_t id = m_Size;
+        for (int r = 0; r < m_Rank; r++) {
+            id += counts[r];
+        }
+        for (int r = 0; r < m_Ranks; r++) {
+            m_Size += counts[r];
+        }
+
+        std::vector<std::vector<Particle>> outgoing(m_Ranks);
+        double radius = 0;
+        for (const auto &particle : m_New) {
+            const int local = particle.first;
+            const int parent = particle.second;
+            const Vector &p = m_Local.Position(local);
+            m_GlobalIds[local] = id;
+            if (m_Output) {
+                *m_Output
+                    << id << "," << m_GlobalIds[parent] << ","
+                    << p.X() << "," << p.Y() << "," << p.Z() << "\n";
+            }
+            for (int r = 0; r < m_Ranks; r++) {
+                if (r != m_Rank && WedgeDistance(r, p) <= m_HaloWidth) {
+                    outgoing[r].push_back(Particle{id, p.X(), p.Y(), p.Z()});
+                }
+            }
+            radius = std::max(radius, p.Length());
+            id++;
+        }
+        m_New.clear();
+        for (const Particle &particle : Exchange(outgoing)) {
+            const Vector p(particle.X, particle.Y, particle.Z);
+            m_Local.Add(p);
+            m_GlobalIds.push_back(particle.ID);
+        }
+        return radius;
+    }
+
+    // ResolveJoins makes the held joins of all ranks that do not come closer
+    // than the particle spacing to any particle placed in this round, once
+    // the others have been published. Joins are considered in rank order,
+    // and a join that comes too close to an earlier one is refused even if
+    // the earlier one is refused too, so that every rank can tell from the
+    // gathered positions alone. Walkers whose joins are refused are pushed
+    // away from their parent, as when ShouldJoin refuses. Returns the
+    // largest distance of a new particle from the origin. It must be called
+    // on all ranks.
+    double ResolveJoins() {
+        std::vector<Walker> positions;
+        for (const PendingJoin &join : m_Pending) {
+            const Vector &q = join.Position;
+            positions.push_back(Walker{q.X(), q.Y(), q.Z()});
+        }
+        uint64_t first;
+        const std::vector<Walker> all = Gather(positions, first);
+        if (all.empty()) {
+            return 0;
+        }
+
+        const double s = m_Local.ParticleSpacing();
+        const double push =
+            m_Local.AttractionDistance() + m_Local.MinMoveDistance();
+        for (size_t k = 0; k < m_Pending.size(); k++) {
+            const PendingJoin &join = m_Pending[k];
+            const Vector &q = join.Position;
+            const size_t index = first + k;
+            bool ok = true;
+            for (size_t i = 0; i < index && ok; i++) {
+                const Vector other(all[i].X, all[i].Y, all[i].Z);
+                ok = (q - other).LengthSquared() >= s * s;
+            }
+            if (ok) {
+                const int nearest = m_Local.Nearest(q);
+                ok = nearest == join.Parent ||
+                    (q - m_Local.Position(nearest)).LengthSquared() >= s * s;
+            }
+            if (ok) {
+                Commit(q, join.Parent);
+                m_Active.push_back(Launch());
+            } else {
+                m_Active.push_back(Quantize(Lerp(
+                    m_Local.Position(join.Parent), join.From, push)));
+            }
+        }
+        m_Pending.clear();
+        return Publish();
+    }
+
+    // Round runs one round of growth in which this rank adds at most quota
+    // particles, then exchanges new particles and walkers with the others
+    void Round(int64_t quota) {
+        // the first walkers are spread evenly over the wedges
+        if (!m_Launched) {
+            const double a0 = 2 * M_PI * m_Rank / m_Ranks;
+            const double a1 = 2 * M_PI * (m_Rank + 1) / m_Ranks;
+            for (int i = 0; i < m_Walkers; i++) {
+                m_Active.push_back(Launch(a0, a1));
+            }
+            m_Launched = true;
+        }
+
+        // walk, collecting walkers that leave the wedge. Walkers whose join
+        // is held stay in the wedge but wait for the end of the round.
+        std::vector<std::vector<Walker>> leaving(m_Ranks);
+        for (size_t i = 0; i < m_Active.size(); ) {
+            Vector &p = m_Active[i];
+            if (Walk(p, quota)) {
+                i++;
+                continue;
+            }
+            if (Owner(p) != m_Rank) {
+                leaving[Owner(p)].push_back(Walker{p.X(), p.Y(), p.Z()});
+            }
+            p = m_Active.back();
+            m_Active.pop_back();
+        }
+
+        // publish the new particles, then decide on the held joins in the
+        // light of them
+        double radius = Publish();
+        radius = std::max(radius, ResolveJoins());
+        for (const Walker &walker : Exchange(leaving)) {
+            m_Active.emplace_back(walker.X, walker.Y, walker.Z);
+        }
+
+        // all ranks launch from the same sphere
+        radius += m_Local.AttractionDistance();
+        MPI_Allreduce(
+            MPI_IN_PLACE, &radius, 1, MPI_DOUBLE, MPI_MAX, m_Comm);
+        m_BoundingRadius = std::max(m_BoundingRadius, radius);
+    }
+
+    MPI_Comm m_Comm;
+    int m_Rank;
+    int m_Ranks;
+    double m_HaloWidth;
+    int m_Walkers;
+    int m_StepsPerRound;
+
+    // m_BoundingRadius bounds the whole cluster, including the attraction
+    // distance, as of the last round and this rank's particles since
+    double m_BoundingRadius;
+
+    // m_Size is the number of particles in the whole cluster as of the last
+    // round
+    int64_t m_Size;
+
+    uint64_t m_WalkSteps;
+    std::ostream *m_Output;
+
+    // m_Local holds the particles in this rank's wedge and halo, and
+    // m_GlobalIds maps its particle ids to global ids (-1 until assigned)
+    Model m_Local;
+    std::vector<int64_t> m_GlobalIds;
+
+    // m_New lists the local ids and local parent ids of the particles added
+    // by this rank in the current round, and m_Pending the joins held until
+    // the end of it
+    std::vector<std::pair<int, int>> m_New;
+    std::vector<PendingJoin> m_Pending;
+
+    // m_Active holds the positions of this rank's walkers. The total number
+    // of walkers stays the same once they have been launched.
+    std::vector<Vector> m_Active;
+    bool m_Launched;
+};
+
+#endif
+
+// SphereBVH is a bounding volume hierarchy over equal-radius spheres, used by
+// the renderer. Nodes have four children whose bounds are stored as
+// structure-of-arrays so that one node's four slab tests run as a single
+// vectorized loop. Leaves hold up to four spheres.
+class SphereBVH {
+public:
+    SphereBVH(const std::vector<Vector> &centers, const float radius) :
+        m_Radius(radius)
+    {
+        const int n = centers.size();
+        std::vector<int> ids(n);
+        for (int i = 0; i < n; i++) {
+            ids[i] = i;
+        }
+        m_X.resize(n);
+        m_Y.resize(n);
+        m_Z.resize(n);
+        m_Nodes.reserve(n / 2 + 1);
+        m_Nodes.emplace_back();
+        Build(centers, ids, 0, n, 0);
+    }
+
+    // Intersect finds the nearest sphere hit by the ray at a distance in
+    // (tmin, tmax). Returns the sphere's position in SphereCenter order, or
+    // -1 if nothing is hit.
+    int Intersect(
+        const float ox, const float oy, const float oz,
+        const float dx, const float dy, const float dz,
+        const float tmin, float &tmax) const
+    {
+        const float ix = 1 / dx, iy = 1 / dy, iz = 1 / dz;
+        const float r2 = m_Radius * m_Radius;
+        int result = -1;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node &node = m_Nodes[stack[--top]];
+            float near[4];
+            bool hit[4];
+            for (int i = 0; i < 4; i++) {
+                float x0, x1, y0, y1, z0, z1;
+                Slab(node.MinX[i], node.MaxX[i], ox, dx, ix, x0, x1);
+                Slab(node.MinY[i], node.MaxY[i], oy, dy, iy, y0, y1);
+                Slab(node.MinZ[i], node.MaxZ[i], oz, dz, iz, z0, z1);
+                const float t0 =
+                    std::max(std::max(x0, y0), std::max(z0, tmin));
+                const float t1 =
+                    std::min(std::min(x1, y1), std::min(z1, tmax));
+                near[i] = t0;
+                hit[i] = t0 <= t1;
+            }
+            // push far children first so the nearest is visited next
+            int order[4] = {0, 1, 2, 3};
+            std::sort(order, order + 4, [&](const int a, const int b) {
+                return near[a] > near[b];
+            });
+            for (const int i : order) {
+                if (!hit[i] || near[i] > tmax) {
+                    continue;
+                }
+                const int child = node.Child[i];
+                if (child >= 0) {
+                    stack[top++] = child;
                     continue;
                 }
+                const int first = ~child;
+                for (int j = first; j < first + node.Count[i]; j++) {
+                    const float cx = ox - m_X[j];
+                    const float cy = oy - m_Y[j];
+                    const float cz = oz - m_Z[j];
+                    const float b = cx * dx + cy * dy + cz * dz;
+                    const float c = cx * cx + cy * cy + cz * cz - r2;
+                    const float disc = b * b - c;
+                    if (disc < 0) {
+                        continue;
+                    }
+                    const float t = -b - std::sqrt(disc);
+                    if (t > tmin && t < tmax) {
+                        tmax = t;
+                        result = j;
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    // SphereCenter returns the center of a sphere returned by Intersect
+    Vector SphereCenter(const int i) const {
+        return Vector(m_X[i], m_Y[i], m_Z[i]);
+    }
+
+private:
+    // Slab returns the range of ray parameters t0 to t1 within the slab lo
+    // to hi along one axis. A zero direction component would give
+    // 0 * inf = NaN for an origin on a bounding plane, so such rays are
+    // either inside the slab everywhere or nowhere.
+    static void Slab(
+        const float lo, const float hi, const float o, const float d,
+        const float inv, float &t0, float &t1)
+    {
+        if (d != 0) {
+            t0 = (lo - o) * inv;
+            t1 = (hi - o) * inv;
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            return;
+        }
+        t0 = lo <= o && o <= hi ? -INFINITY : INFINITY;
+        t1 = INFINITY;
+    }
+
+    struct Node {
+        float MinX[4], MinY[4], MinZ[4];
+        float MaxX[4], MaxY[4], MaxZ[4];
+        // Child is a node index, or the bitwise complement of the first
+        // sphere of a leaf with Count spheres
+        int Child[4];
+        int Count[4];
+    };
+
+    // Build fills in node from the spheres ids[lo, hi) by splitting them
+    // twice at the median along the longest axis into four children
+    void Build(
+        const std::vector<Vector> &centers, std::vector<int> &ids,
+        const int lo, const int hi, const int node)
+    {
+        int bounds[5] = {lo, 0, (lo + hi) / 2, 0, hi};
+        Split(centers, ids, bounds[0], bounds[4]);
+        bounds[1] = (bounds[0] + bounds[2]) / 2;
+        bounds[3] = (bounds[2] + bounds[4]) / 2;
+        Split(centers, ids, bounds[0], bounds[2]);
+        Split(centers, ids, bounds[2], bounds[4]);
+        for (int i = 0; i < 4; i++) {
+            const int a = bounds[i];
+            const int b = bounds[i + 1];
+            float lo3[3] = {INFINITY, INFINITY, INFINITY};
+            float hi3[3] = {-INFINITY, -INFINITY, -INFINITY};
+            for (int j = a; j < b; j++) {
+                const Vector &c = centers[ids[j]];
+                const float v[3] = {(float)c.X(), (float)c.Y(), (float)c.Z()};
+                for (int k = 0; k < 3; k++) {
+                    lo3[k] = std::min(lo3[k], v[k] - m_Radius);
+                    hi3[k] = std::max(hi3[k], v[k] + m_Radius);
+                }
+            }
+            Node &n = m_Nodes[node];
+            n.MinX[i] = lo3[0]; n.MinY[i] = lo3[1]; n.MinZ[i] = lo3[2];
+            n.MaxX[i] = hi3[0]; n.MaxY[i] = hi3[1]; n.MaxZ[i] = hi3[2];
+            n.Count[i] = 0;
+            if (b - a <= 4) {
+                // leaf: copy the spheres into their final order
+                for (int j = a; j < b; j++) {
+                    const Vector &c = centers[ids[j]];
+                    m_X[j] = c.X();
+                    m_Y[j] = c.Y();
+                    m_Z[j] = c.Z();
+                }
+                n.Child[i] = ~a;
+                n.Count[i] = b - a;
+            } else {
+                const int child = m_Nodes.size();
+                n.Child[i] = child;
+                m_Nodes.emplace_back();
+                Build(centers, ids, a, b, child);
+            }
+        }
+    }
+
+    // Split partitions ids[lo, hi) at the median along the longest axis of
+    // the centers' bounding box
+    static void Split(
+        const std::vector<Vector> &centers, std::vector<int> &ids,
+        const int lo, const int hi)
+    {
+        if (hi - lo < 2) {
+            return;
+        }
+        Vector a = centers[ids[lo]];
+        Vector b = a;
+        for (int i = lo; i < hi; i++) {
+            const Vector &c = centers[ids[i]];
+            a = Vector(
+                std::min(a.X(), c.X()), std::min(a.Y(), c.Y()),
+                std::min(a.Z(), c.Z()));
+            b = Vector(
+                std::max(b.X(), c.X()), std::max(b.Y(), c.Y()),
+                std::max(b.Z(), c.Z()));
+        }
+        const Vector size = b - a;
+        const int axis = size.X() > size.Y() ?
+            (size.X() > size.Z() ? 0 : 2) : (size.Y() > size.Z() ? 1 : 2);
+        const auto key = [&](const int i) {
+            const Vector &c = centers[i];
+            return axis == 0 ? c.X() : (axis == 1 ? c.Y() : c.Z());
+        };
+        std::nth_element(
+            ids.begin() + lo, ids.begin() + (lo + hi) / 2, ids.begin() + hi,
+            [&](const int i, const int j) { return key(i) < key(j); });
+    }
+
+    float m_Radius;
+    std::vector<float> m_X;
+    std::vector<float> m_Y;
+    std::vector<float> m_Z;
+    std::vector<Node> m_Nodes;
+};
+
+// RenderOptions configures Render. Leaving Eye, Center and Up at zero frames
+// the whole cluster automatically.
+struct RenderOptions {
+    int Width = 1024;
+    int Height = 1024;
+    int Samples = 16;
+    int Bounces = 4;
+    int Threads = std::thread::hardware_concurrency();
+    double Radius = DefaultParticleSpacing / 2;
+    double FieldOfView = 30;
+    double Albedo = 0.8;
+    double Background = 0;
+    Vector Eye;
+    Vector Center;
+    Vector Up;
+};
+
+// Render path traces the model's particles as spheres lit by a uniform white
+// sky, seen against a plain background, and writes the image as a binary PPM.
+// The image is split into tiles that the worker threads claim from a shared
+// atomic counter, so threads that finish early keep taking work. Each tile has
+// its own random stream, so the result does not depend on the number of
+// threads. Returns false if the file could not be written.
+bool Render(
+    const Model &model, RenderOptions options, const std::string &path)
+{
+    const int tileSize = 32;
+    const int n = model.Size();
+    std::vector<Vector> centers(n);
+    for (int i = 0; i < n; i++) {
+        centers[i] = model.Position(i);
+    }
+    const SphereBVH bvh(centers, options.Radius);
+
+    // frame the cluster if no camera was given
+    if (options.Up.LengthSquared() == 0) {
+        const double r = model.BoundingRadius();
+        const double d = r / std::tan(options.FieldOfView * M_PI / 360);
+        options.Center = Vector();
+        options.Eye = D == 2 ? Vector(0, 0, d) : Vector(d, d, d) * 0.6;
+        options.Up = Vector(0, 1, 0);
+    }
+    const Vector w = (options.Eye - options.Center).Normalized();
+    const Vector u = options.Up.Cross(w).Normalized();
+    const Vector v = w.Cross(u);
+    const double scale = std::tan(options.FieldOfView * M_PI / 360);
+    const double aspect = (double)options.Width / options.Height;
+
+    const int tilesX = (options.Width + tileSize - 1) / tileSize;
+    const int tilesY = (options.Height + tileSize - 1) / tileSize;
+    std::vector<float> image(options.Width * options.Height * 3);
+    std::atomic<int> nextTile(0);
+
+    const auto worker = [&]() {
+        while (true) {
+            const int tile = nextTile++;
+            if (tile >= tilesX * tilesY) {
+                return;
+            }
+            std::mt19937 gen(tile);
+            std::uniform_real_distribution<double> random(0, 1);
+            const int x0 = tile % tilesX * tileSize;
+            const int y0 = tile / tilesX * tileSize;
+            const int x1 = std::min(x0 + tileSize, options.Width);
+            const int y1 = std::min(y0 + tileSize, options.Height);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    double sum = 0;
+                    for (int s = 0; s < options.Samples; s++) {
+                        const double px = (2 * (x + random(gen)) /
+                            options.Width - 1) * scale * aspect;
+                        const double py = (1 - 2 * (y + random(gen)) /
+                            options.Height) * scale;
+                        Vector o = options.Eye;
+                        Vector d = (u * px + v * py - w).Normalized();
+                        double throughput = 1;
+                        for (int bounce = 0; ; bounce++) {
+                            float t = INFINITY;
+                            const int hit = bvh.Intersect(
+                                o.X(), o.Y(), o.Z(), d.X(), d.Y(), d.Z(),
+                                0, t);
+                            if (hit < 0) {
+                                sum += bounce == 0 ?
+                                    options.Background : throughput;
+                                break;
+                            }
+                            if (bounce == options.Bounces) {
+                                break;
+                            }
+                            const Vector p = o + d * t;
+                            const Vector normal =
+                                (p - bvh.SphereCenter(hit)).Normalized();
+                            o = p + normal * (options.Radius * 1e-3);
+
+                            // cosine weighted direction around the normal
+                            const double a = random(gen) * 2 * M_PI;
+                            const double r2 = random(gen);
+                            const double r = std::sqrt(r2);
+                            const Vector h = std::abs(normal.X()) < 0.9 ?
+                                Vector(1, 0, 0) : Vector(0, 1, 0);
+                            const Vector nu = normal.Cross(h).Normalized();
+                            const Vector nv = normal.Cross(nu);
+                            d = (nu * (std::cos(a) * r) +
+                                nv * (std::sin(a) * r) +
+                                normal * std::sqrt(1 - r2)).Normalized();
+                            throughput *= options.Albedo;
+                        }
+                    }
+                    const float c = sum / options.Samples;
+                    float *pixel = &image[(y * options.Width + x) * 3];
+                    pixel[0] = pixel[1] = pixel[2] = c;
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < std::max(1, options.Threads); i++) {
+        pool.emplace_back(worker);
+    }
+    for (auto &thread : pool) {
+        thread.join();
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << options.Width << " " << options.Height << "\n255\n";
+    for (const float c : image) {
+        const float g = std::pow(std::min(std::max(c, 0.0f), 1.0f), 1 / 2.2f);
+        out.put((char)(uint8_t)std::lround(g * 255));
+    }
+    return (bool)out;
+}
+
+// MeshOptions configures ExportMesh. The surface wraps tubes of the given
+// radius along every link between a particle and its parent. CellSize is the
+// spacing of the sampling grid and sets the level of detail.
+struct MeshOptions {
+    double Radius = DefaultParticleSpacing / 2;
+    double CellSize = DefaultParticleSpacing / 2;
+    int Threads = std::thread::hardware_concurrency();
+};
+
+// ExportMesh extracts a closed triangle mesh around the model's branches and
+// writes it as binary STL if the path ends in ".stl" and as binary PLY
+// otherwise. The distance field is only sampled in sparse bricks of cells next
+// to particles, and the bricks are polygonized in parallel with marching
+// tetrahedra on a Kuhn split of every cell, which cannot leave cracks between
+// neighboring cells. The PLY mesh has its shared vertices welded, so it is
+// watertight but kept in memory until written. STL is a plain list of
+// triangles, so it is streamed out as bricks finish and needs little memory.
+// Links that are much longer than the particle spacing, such as those that
+// wrap around a periodic box, are left out. Returns false if the file could
+// not be written. Throws std::out_of_range if a particle is 2^19 cells or
+// more from the origin along an axis, as cells are keyed by 20-bit
+// coordinates.
+bool ExportMesh(
+    const Model &model, const MeshOptions &options, const std::string &path)
+{
+    const double h = options.CellSize;
+    const double r = options.Radius;
+    const double maxLink = model.ParticleSpacing() * 1.5;
+    // a brick must be wider than the reach of a link so that the links that
+    // start in the surrounding bricks are all that matter to it
+    const double reach = r + 2 * h;
+    const int B = std::max(8, (int)std::ceil((reach + maxLink) / h));
+    const int S = B + 1;
+    const int chunkSize = 64;
+    const int64_t offset = 1 << 19;
+    const uint64_t mask = (1 << 20) - 1;
+    const std::string stl = ".stl";
+    const bool soup = path.size() >= stl.size() &&
+        path.compare(path.size() - stl.size(), stl.size(), stl) == 0;
+
+    const auto brickKey = [&](
+        const int64_t x, const int64_t y, const int64_t z)
+    {
+        return (uint64_t)(x + offset) << 40 |
+            (uint64_t)(y + offset) << 20 | (uint64_t)(z + offset);
+    };
+    const auto edgeKey = [&](
+        const int64_t x, const int64_t y, const int64_t z, const int dir)
+    {
+        return (uint64_t)(x + offset) << 43 | (uint64_t)(y + offset) << 23 |
+            (uint64_t)(z + offset) << 3 | dir;
+    };
+
+    // sort the links by the brick of their child particle
+    const int n = model.Size();
+    std::vector<std::pair<uint64_t, int>> particles(n);
+    for (int i = 0; i < n; i++) {
+        const Vector &p = model.Position(i);
+        // the cells sampled around a particle reach up to three bricks from
+        // it, and their coordinates must fit the keys without colliding
+        const double extent = std::max(std::abs(p.X()),
+            std::max(std::abs(p.Y()), std::abs(p.Z()))) / h + 3 * B;
+        if (!(extent < offset)) {
+            throw std::out_of_range(
+                "ExportMesh: the cluster spans too many cells");
+        }
+        particles[i] = std::make_pair(brickKey(
+            std::floor(p.X() / (B * h)),
+            std::floor(p.Y() / (B * h)),
+            std::floor(p.Z() / (B * h))), i);
+    }
+    std::sort(particles.begin(), particles.end());
+    std::vector<uint64_t> occupied;
+    std::vector<int> ranges;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || particles[i].first != particles[i - 1].first) {
+            occupied.push_back(particles[i].first);
+            ranges.push_back(i);
+        }
+    }
+    ranges.push_back(n);
+
+    // only bricks next to an occupied brick can contain any surface
+    std::vector<uint64_t> active;
+    active.reserve(occupied.size() * 27);
+    for (const uint64_t key : occupied) {
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dz = -1; dz <= 1; dz++) {
+                    active.push_back(key + brickKey(dx, dy, dz) -
+                        brickKey(0, 0, 0));
+                }
+            }
+        }
+    }
+    std::sort(active.begin(), active.end());
+    active.erase(std::unique(active.begin(), active.end()), active.end());
 
-                // adjust particle position in relation to its parent
-                p = PlaceParticle(p, parent);
+    // each chunk of bricks keeps the vertices it owns, the keys of welded
+    // vertices owned by other bricks and triangles referring to either
+    struct Chunk {
+        std::vector<float> Vertices;
+        std::vector<std::pair<uint64_t, uint32_t>> Shared;
+        std::vector<uint64_t> Foreign;
+        std::vector<uint32_t> Triangles;
+    };
+    const uint32_t foreignBit = 1u << 31;
+    const int numChunks = (active.size() + chunkSize - 1) / chunkSize;
+    std::vector<Chunk> chunks(numChunks);
+    std::atomic<int> nextChunk(0);
 
-                // add the point
-                Add(p, parent);
+    // STL triangles are written as soon as all earlier chunks are written, so
+    // the file does not depend on the number of threads
+    std::ofstream out(path, std::ios::binary);
+    std::mutex mutex;
+    std::vector<char> done(numChunks);
+    int flushed = 0;
+    uint32_t numTriangles = 0;
+    const uint16_t attributes = 0;
+    if (soup) {
+        const std::string header(80, '\0');
+        out.write(header.data(), header.size());
+        out.write((const char *)&numTriangles, sizeof(numTriangles));
+    }
+
+    const auto worker = [&]() {
+        std::vector<double> field(S * S * S);
+        std::vector<uint32_t> vertexMap(S * S * S * 7, 0);
+        std::vector<int> touched;
+        while (true) {
+            const int c = nextChunk++;
+            if (c >= numChunks) {
                 return;
             }
+            Chunk &chunk = chunks[c];
+            const int end = std::min<int>((c + 1) * chunkSize, active.size());
+            for (int b = c * chunkSize; b < end; b++) {
+                const int64_t bx = (int64_t)(active[b] >> 40 & mask) - offset;
+                const int64_t by = (int64_t)(active[b] >> 20 & mask) - offset;
+                const int64_t bz = (int64_t)(active[b] & mask) - offset;
+                const int64_t x0 = bx * B, y0 = by * B, z0 = bz * B;
+
+                // squared distance to the nearest link at every sample
+                std::fill(field.begin(), field.end(), INFINITY);
+                for (int d = 0; d < 27; d++) {
+                    const uint64_t key = brickKey(
+                        bx + d % 3 - 1, by + d / 3 % 3 - 1, bz + d / 9 - 1);
+                    const auto it = std::lower_bound(
+                        occupied.begin(), occupied.end(), key);
+                    if (it == occupied.end() || *it != key) {
+                        continue;
+                    }
+                    const int o = it - occupied.begin();
+                    for (int i = ranges[o]; i < ranges[o + 1]; i++) {
+                        const int id = particles[i].second;
+                        const Vector &a = model.Position(id);
+                        Vector b = a;
+                        if (model.Parent(id) >= 0) {
+                            b = model.Position(model.Parent(id));
+                            if (a.Distance(b) > maxLink) {
+                                b = a;
+                            }
+                        }
+                        const Vector ab = b - a;
+                        const double abab = std::max(ab.LengthSquared(), 1e-30);
+                        const auto lo = [&](
+                            const double u, const double v, const int64_t s)
+                        {
+                            return (int)std::max<int64_t>(
+                                0, std::ceil((std::min(u, v) - reach) / h) - s);
+                        };
+                        const auto hi = [&](
+                            const double u, const double v, const int64_t s)
+                        {
+                            return (int)std::min<int64_t>(B,
+                                std::floor((std::max(u, v) + reach) / h) - s);
+                        };
+                        const int i0 = lo(a.X(), b.X(), x0);
+                        const int i1 = hi(a.X(), b.X(), x0);
+                        const int j0 = lo(a.Y(), b.Y(), y0);
+                        const int j1 = hi(a.Y(), b.Y(), y0);
+                        const int k0 = lo(a.Z(), b.Z(), z0);
+                        const int k1 = hi(a.Z(), b.Z(), z0);
+                        for (int ii = i0; ii <= i1; ii++) {
+                            for (int jj = j0; jj <= j1; jj++) {
+                                double *row = &field[(ii * S + jj) * S];
+                                for (int kk = k0; kk <= k1; kk++) {
+                                    // squared distance to the segment
+                                    const Vector ap = Vector(
+                                        (x0 + ii) * h, (y0 + jj) * h,
+                                        (z0 + kk) * h) - a;
+                                    const double t = std::min(std::max(
+                                        ap.Dot(ab) / abab, 0.0), 1.0);
+                                    const double d2 =
+                                        (ap - ab * t).LengthSquared();
+                                    row[kk] = std::min(row[kk], d2);
+                                }
+                            }
+                        }
+                    }
+                }
+                bool inside = false;
+                for (double &f : field) {
+                    f = std::sqrt(f) - r;
+                    inside |= f < 0;
+                }
+                if (!inside) {
+                    continue;
+                }
 
-            // move randomly
-            const double m = std::max(
-                m_MinMoveDistance, d - m_AttractionDistance);
-            p += MotionVector(p).Normalized() * m;
+                for (const int i : touched) {
+                    vertexMap[i] = 0;
+                }
+                touched.clear();
+
+                // returns a reference to the vertex on the edge between two
+                // corners of a Kuhn tetrahedron; corner a is below corner b
+                const auto vertex = [&](
+                    const int ci, const int cj, const int ck,
+                    int a, int b, Vector &position)
+                {
+                    if ((a & b) != a) {
+                        std::swap(a, b);
+                    }
+                    const int dir = a ^ b;
+                    const int li = ci + (a & 1), lj = cj + (a >> 1 & 1),
+                        lk = ck + (a >> 2 & 1);
+                    const double fa = field[(li * S + lj) * S + lk];
+                    const double fb = field[((li + (dir & 1)) * S +
+                        lj + (dir >> 1 & 1)) * S + lk + (dir >> 2 & 1)];
+                    const double t = fa / (fa - fb);
+                    position = Vector(
+                        (x0 + li + t * (dir & 1)) * h,
+                        (y0 + lj + t * (dir >> 1 & 1)) * h,
+                        (z0 + lk + t * (dir >> 2 & 1)) * h);
+                    if (soup) {
+                        return 0u;
+                    }
+                    const int slot = ((li * S + lj) * S + lk) * 7 + dir - 1;
+                    if (vertexMap[slot]) {
+                        return vertexMap[slot] - 1;
+                    }
+                    uint32_t ref;
+                    if (li < B && lj < B && lk < B) {
+                        ref = chunk.Vertices.size() / 3;
+                        chunk.Vertices.push_back(position.X());
+                        chunk.Vertices.push_back(position.Y());
+                        chunk.Vertices.push_back(position.Z());
+                        if (li == 0 || lj == 0 || lk == 0) {
+                            chunk.Shared.emplace_back(edgeKey(
+                                x0 + li, y0 + lj, z0 + lk, dir), ref);
+                        }
+                    } else {
+                        ref = chunk.Foreign.size() | foreignBit;
+                        chunk.Foreign.push_back(edgeKey(
+                            x0 + li, y0 + lj, z0 + lk, dir));
+                    }
+                    vertexMap[slot] = ref + 1;
+                    touched.push_back(slot);
+                    return ref;
+                };
 
-            // check if particle is too far away, reset if so
-            if (ShouldReset(p)) {
-                p = RandomStartingPosition();
+                // emits a triangle facing away from the inside corners. The
+                // facing is decided with the midpoints of the cut edges, which
+                // never form a degenerate triangle.
+                const auto triangle = [&](
+                    const uint32_t *refs, const Vector *positions,
+                    const Vector *midpoints, const Vector &outward)
+                {
+                    const bool flip = (midpoints[1] - midpoints[0]).Cross(
+                        midpoints[2] - midpoints[0]).Dot(outward) < 0;
+                    if (soup) {
+                        const Vector normal =
+                            (positions[1] - positions[0]).Cross(
+                                positions[2] - positions[0]);
+                        const Vector n = normal * ((flip ? -1 : 1) /
+                            std::max(normal.Length(), 1e-30));
+                        const int order[3] = {0, 1, 2};
+                        const int flipped[3] = {0, 2, 1};
+                        const int *o = flip ? flipped : order;
+                        chunk.Vertices.push_back(n.X());
+                        chunk.Vertices.push_back(n.Y());
+                        chunk.Vertices.push_back(n.Z());
+                        for (int k = 0; k < 3; k++) {
+                            chunk.Vertices.push_back(positions[o[k]].X());
+                            chunk.Vertices.push_back(positions[o[k]].Y());
+                            chunk.Vertices.push_back(positions[o[k]].Z());
+                        }
+                        return;
+                    }
+                    chunk.Triangles.push_back(refs[0]);
+                    if (flip) {
+                        chunk.Triangles.push_back(refs[2]);
+                        chunk.Triangles.push_back(refs[1]);
+                    } else {
+                        chunk.Triangles.push_back(refs[1]);
+                        chunk.Triangles.push_back(refs[2]);
+                    }
+                };
+
+                static const int axes[6][3] = {
+                    {1, 2, 4}, {1, 4, 2}, {2, 1, 4},
+                    {2, 4, 1}, {4, 1, 2}, {4, 2, 1}};
+                for (int cell = 0; cell < B * B * B; cell++) {
+                    const int ci = cell / (B * B), cj = cell / B % B,
+                        ck = cell % B;
+                    double corners[8];
+                    int signs = 0;
+                    for (int k = 0; k < 8; k++) {
+                        corners[k] = field[((ci + (k & 1)) * S +
+                            cj + (k >> 1 & 1)) * S + ck + (k >> 2 & 1)];
+                        signs |= (corners[k] < 0) << k;
+                    }
+                    if (signs == 0 || signs == 255) {
+                        continue;
+                    }
+                    for (const auto &axis : axes) {
+                        const int tet[4] = {
+                            0, axis[0], axis[0] | axis[1], 7};
+                        int in[4], out[4], numIn = 0, numOut = 0;
+                        Vector inCenter, outCenter;
+                        for (const int k : tet) {
+                            const Vector corner(
+                                k & 1, k >> 1 & 1, k >> 2 & 1);
+                            if (corners[k] < 0) {
+                                in[numIn++] = k;
+                                inCenter += corner;
+                            } else {
+                                out[numOut++] = k;
+                                outCenter += corner;
+                            }
+                        }
+                        if (numIn == 0 || numOut == 0) {
+                            continue;
+                        }
+                        const Vector outward = outCenter * (1.0 / numOut) -
+                            inCenter * (1.0 / numIn);
+                        uint32_t refs[4];
+                        Vector positions[4];
+                        Vector midpoints[4];
+                        const auto cut = [&](
+                            const int k, const int a, const int b)
+                        {
+                            refs[k] = vertex(ci, cj, ck, a, b, positions[k]);
+                            midpoints[k] = Vector(
+                                (a & 1) + (b & 1), (a >> 1 & 1) + (b >> 1 & 1),
+                                (a >> 2 & 1) + (b >> 2 & 1));
+                        };
+                        if (numIn == 2) {
+                            // split the quad around the four cut edges
+                            for (int k = 0; k < 4; k++) {
+                                cut(k, in[k / 2], out[(k + 1) / 2 % 2]);
+                            }
+                            triangle(refs, positions, midpoints, outward);
+                            refs[1] = refs[3];
+                            positions[1] = positions[3];
+                            midpoints[1] = midpoints[3];
+                            triangle(refs, positions, midpoints, outward);
+                        } else {
+                            const int lone = numIn == 1 ? in[0] : out[0];
+                            const int *others = numIn == 1 ? out : in;
+                            for (int k = 0; k < 3; k++) {
+                                cut(k, lone, others[k]);
+                            }
+                            triangle(refs, positions, midpoints, outward);
+                        }
+                    }
+                }
+            }
+            if (soup) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done[c] = true;
+                for (; flushed < numChunks && done[flushed]; flushed++) {
+                    std::vector<float> &records = chunks[flushed].Vertices;
+                    for (size_t i = 0; i < records.size(); i += 12) {
+                        out.write((const char *)&records[i], 48);
+                        out.write((const char *)&attributes, 2);
+                    }
+                    numTriangles += records.size() / 12;
+                    std::vector<float>().swap(records);
+                }
             }
         }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < std::max(1, options.Threads); i++) {
+        pool.emplace_back(worker);
+    }
+    for (auto &thread : pool) {
+        thread.join();
+    }
+    if (soup) {
+        out.seekp(80);
+        out.write((const char *)&numTriangles, sizeof(numTriangles));
+        return (bool)out;
     }
 
-private:
-    // m_ParticleSpacing defines the distance between particles that are
-    // joined together
-    double m_ParticleSpacing;
+    // weld the vertices on brick faces and gather everything in order
+    std::vector<float> vertices;
+    std::vector<std::pair<uint64_t, uint32_t>> shared;
+    std::vector<uint32_t> bases;
+    for (Chunk &chunk : chunks) {
+        const uint32_t base = vertices.size() / 3;
+        bases.push_back(base);
+        vertices.insert(
+            vertices.end(), chunk.Vertices.begin(), chunk.Vertices.end());
+        std::vector<float>().swap(chunk.Vertices);
+        for (const auto &s : chunk.Shared) {
+            shared.emplace_back(s.first, base + s.second);
+        }
+        std::vector<std::pair<uint64_t, uint32_t>>().swap(chunk.Shared);
+    }
+    std::sort(shared.begin(), shared.end());
 
-    // m_AttractionDistance defines how close together particles must be in
-    // order to join together
-    double m_AttractionDistance;
+    for (const Chunk &chunk : chunks) {
+        numTriangles += chunk.Triangles.size() / 3;
+    }
+    out << "ply\nformat binary_little_endian 1.0\n"
+        << "element vertex " << vertices.size() / 3 << "\n"
+        << "property float x\nproperty float y\nproperty float z\n"
+        << "element face " << numTriangles << "\n"
+        << "property list uchar uint vertex_indices\nend_header\n";
+    out.write((const char *)vertices.data(), vertices.size() * sizeof(float));
+    for (int c = 0; c < numChunks; c++) {
+        const Chunk &chunk = chunks[c];
+        for (size_t i = 0; i < chunk.Triangles.size(); i += 3) {
+            uint32_t face[3];
+            for (int k = 0; k < 3; k++) {
+                const uint32_t ref = chunk.Triangles[i + k];
+                if (!(ref & foreignBit)) {
+                    face[k] = bases[c] + ref;
+                    continue;
+                }
+                const uint64_t key = chunk.Foreign[ref & ~foreignBit];
+                const auto it = std::lower_bound(shared.begin(), shared.end(),
+                    std::make_pair(key, (uint32_t)0));
+                if (it == shared.end() || it->first != key) {
+                    throw std::logic_error("unmatched vertex on a brick face");
+                }
+                face[k] = it->second;
+            }
+            const uint8_t count = 3;
+            out.write((const char *)&count, sizeof(count));
+            out.write((const char *)face, sizeof(face));
+        }
+    }
+    return (bool)out;
+}
 
-    // m_MinMoveDistance defines the minimum distance that a particle will move
-    // during its random walk
-    double m_MinMoveDistance;
+// MetricsExporter periodically writes the progress of a growing model to a
+// file in the Prometheus text exposition format, e.g. for the node exporter's
+// textfile collector. The file is replaced atomically so readers never see a
+// partial update. Writing happens on a background thread that only reads the
+// model's published counters, so the simulation is not slowed down.
+class MetricsExporter {
+public:
+    MetricsExporter(
+        const Model &model, const std::string &path,
+        const uint64_t targetParticles = 0,
+        const double intervalSeconds = 5) :
+        m_Model(model),
+        m_Path(path),
+        m_TargetParticles(targetParticles),
+        m_Interval(intervalSeconds),
+        m_Start(std::chrono::steady_clock::now()),
+        m_LastTime(m_Start),
+        m_LastParticles(model.ParticleCount()),
+        m_Stop(false),
+        m_Thread(&MetricsExporter::Run, this) {}
 
-    // m_Stubbornness defines how many interactions must occur before a
-    // particle will allow another particle to join to it.
-    int m_Stubbornness;
+    MetricsExporter(const MetricsExporter &) = delete;
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
 
-    // m_Stickiness defines the probability that a particle will allow another
-    // particle to join to it.
-    double m_Stickiness;
+    // the destructor stops the thread and writes a final update
+    ~MetricsExporter() {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Stop = true;
+        }
+        m_Condition.notify_all();
+        m_Thread.join();
+        Write();
+    }
 
-    // m_BoundingRadius defines the radius of the bounding sphere that bounds
-    // all of the particles
-    double m_BoundingRadius;
+private:
+    void Run() {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        while (!m_Condition.wait_for(lock, m_Interval, [this] {
+            return m_Stop;
+        })) {
+            Write();
+        }
+    }
 
-    // m_Points stores the final particle positions
-    std::vector<Vector> m_Points;
+    void Write() {
+        const auto now = std::chrono::steady_clock::now();
+        const uint64_t particles = m_Model.ParticleCount();
+        const double elapsed =
+            std::chrono::duration<double>(now - m_Start).count();
+        const double interval =
+            std::chrono::duration<double>(now - m_LastTime).count();
+        const double rate = interval > 0 ?
+            (particles - m_LastParticles) / interval : 0;
+        m_LastTime = now;
+        m_LastParticles = particles;
+
+        const std::string tmp = m_Path + ".tmp";
+        std::ofstream out(tmp);
+        WriteMetric(out, "dlaf_particles_total", "counter",
+            "Particles added to the model.", particles);
+        WriteMetric(out, "dlaf_walk_steps_total", "counter",
+            "Random walk steps taken.", m_Model.WalkSteps());
+        WriteMetric(out, "dlaf_resets_total", "counter",
+            "Walkers reset for going too far away.", m_Model.Resets());
+        WriteMetric(out, "dlaf_join_rejections_total", "counter",
+            "Join attempts rejected by ShouldJoin.", m_Model.JoinRejections());
+        const uint64_t frozen = m_Model.FrozenIndexSize();
+        WriteMetric(out, "dlaf_index_frozen_size", "gauge",
+            "Particles in the static tier of the spatial index.", frozen);
+        WriteMetric(out, "dlaf_index_frontier_size", "gauge",
+            "Particles in the frontier tier of the spatial index.",
+            particles > frozen ? particles - frozen : 0);
+        WriteMetric(out, "dlaf_bounding_radius", "gauge",
+            "Radius of the sphere bounding all particles.",
+            m_Model.PublishedBoundingRadius());
+        WriteMetric(out, "dlaf_particles_per_second", "gauge",
+            "Particles added per second since the last update.", rate);
+        WriteMetric(out, "dlaf_elapsed_seconds", "gauge",
+            "Seconds since the exporter was started.", elapsed);
+        if (m_TargetParticles > 0 && rate > 0) {
+            const double remaining = particles < m_TargetParticles ?
+                m_TargetParticles - particles : 0;
+            WriteMetric(out, "dlaf_eta_seconds", "gauge",
+                "Estimated seconds until the target particle count.",
+                remaining / rate);
+        }
+        WriteMetric(out, "dlaf_resident_memory_bytes", "gauge",
+            "Resident set size of the process.", ResidentMemory());
+        out.close();
+        std::rename(tmp.c_str(), m_Path.c_str());
+    }
+
+    template <typename T>
+    static void WriteMetric(
+        std::ostream &out, const char *name, const char *type,
+        const char *help, const T value)
+    {
+        out
+            << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " " << type << "\n"
+            << name << " " << value << "\n";
+    }
 
-    // m_JoinAttempts tracks how many times other particles have attempted to
-    // join with each finalized particle
-    std::vector<int> m_JoinAttempts;
+    // ResidentMemory returns the resident set size in bytes, or 0 if it is
+    // not available
+    static uint64_t ResidentMemory() {
+        std::ifstream statm("/proc/self/statm");
+        uint64_t size, resident;
+        if (!(statm >> size >> resident)) {
+            return 0;
+        }
+        return resident * sysconf(_SC_PAGESIZE);
+    }
 
-    // m_Index is the spatial index used to accelerate nearest neighbor queries
-    Index m_Index;
+    const Model &m_Model;
+    std::string m_Path;
+    uint64_t m_TargetParticles;
+    std::chrono::duration<double> m_Interval;
+    std::chrono::steady_clock::time_point m_Start;
+    std::chrono::steady_clock::time_point m_LastTime;
+    uint64_t m_LastParticles;
+    bool m_Stop;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::thread m_Thread;
 };
 
-int main() {
+// ConvertDeltaToCSV reads a delta-encoded stream and writes the same CSV
+// format that Model writes. Returns false if the stream is not valid.
+bool ConvertDeltaToCSV(std::istream &in, std::ostream &out) {
+    DeltaReader reader(in);
+    if (!reader.Valid()) {
+        return false;
+    }
+    int id, parent;
+    Vector p;
+    while (reader.Next(id, parent, p)) {
+        out
+            << id << "," << parent << ","
+            << p.X() << "," << p.Y() << "," << p.Z() << "\n";
+    }
+    out.flush();
+    return true;
+}
+
+// define DLAF_NO_MAIN to include this file in another program or library
+// (see dlaf_python.cpp)
+#ifndef DLAF_NO_MAIN
+int main(int argc, char **argv) {
+    // number of particles to add
+    const int n = 100000;
+
+#ifdef DLAF_MPI
+    // grow one cluster across all MPI ranks, each writing the particles it
+    // creates to its own file: mpirun -n 4 ./dlaf-mpi
+    {
+        MPI_Init(&argc, &argv);
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        SeedRandom(1 + rank);
+        std::ofstream out("output-" + std::to_string(rank) + ".csv");
+        DistributedModel model(MPI_COMM_WORLD);
+        model.SetOutput(&out);
+        model.Add(Vector());
+        const auto start = std::chrono::steady_clock::now();
+        model.Grow(n);
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        const uint64_t steps = model.WalkSteps();
+        if (rank == 0) {
+            std::cerr
+                << model.Size() << " particles in " << elapsed.count()
+                << "s, " << steps << " walk steps" << std::endl;
+        }
+        out.flush();
+        MPI_Finalize();
+        return 0;
+    }
+#endif
+
+    // run an ensemble of independent models instead of a single one
+    // {
+    //     const auto results = RunEnsemble(100, 10000, 1, [](Model &m) {
+    //         m.Add(Vector());
+    //     });
+    //     WriteEnsembleStats(std::cout, results);
+    //     return 0;
+    // }
+
+    // measure how ensemble throughput scales across NUMA nodes
+    // {
+    //     BenchmarkNumaScaling(std::cout, 4, 10000);
+    //     return 0;
+    // }
+
     // create the model
     Model model;
+    model.Reserve(n + 1);
+
+    // write compact delta-encoded output instead of CSV
+    // std::ofstream delta("output.dlaf", std::ios::binary);
+    // model.SetOutput(nullptr);
+    // model.SetDeltaOutput(&delta);
+
+    // write animation frames at every 5% of growth
+    // std::ofstream snapshots("output.dlas", std::ios::binary);
+    // model.SetSnapshotOutput(&snapshots, 100, 1.05);
+
+    // add a constant drift towards -y, sampled onto a grid
+    // BiasField bias(
+    //     Vector(-1000, -1000, -1000), Vector(1000, 1000, 1000), 64);
+    // bias.Sample([](const Vector &p) {
+    //     return Vector(0, -0.2, 0);
+    // });
+    // model.SetBiasField(&bias);
+
+    // grow upwards from a substrate in a periodic strip (instead of the
+    // seed below)
+    // {
+    //     const double w = 1000;
+    //     model.SetPeriodicBox(w);
+    //     for (int i = 0; i < w; i++) {
+    //         model.Add(Vector(i, 0, 0));
+    //     }
+    // }
 
     // add seed point(s)
     model.Add(Vector());
@@ -307,10 +5356,84 @@ int main() {
     //     }
     // }
 
+    // grow with ballistic aggregation or the Eden model instead
+    // {
+    //     for (int i = 0; i < n; i++) {
+    //         model.AddParticleBallistic();
+    //         // model.AddParticleEden();
+    //     }
+    //     return 0;
+    // }
+
+    // grow with the dielectric breakdown model instead
+    // {
+    //     model.SetDielectricBreakdown(512);
+    //     while (model.AddParticleDBM()) {}
+    //     return 0;
+    // }
+
+    // share particles with a consumer on another thread via a lock-free log
+    // ParticleLog log;
+    // model.SetLog(&log);
+    // std::atomic<bool> done(false);
+    // std::thread consumer([&]() {
+    //     size_t next = 0;
+    //     while (!done || next < log.Size()) {
+    //         next = log.Read(next, [](const LogEntry *e, size_t count) {
+    //             // consume count entries starting at e
+    //         });
+    //         std::this_thread::yield();
+    //     }
+    // });
+    // ... grow the model, then: done = true; consumer.join();
+
+    // count hardware events in the phases of AddParticle
+    // PerfCounters perf;
+    // model.SetPerfCounters(&perf);
+    // ... grow the model, then: perf.Write(std::cerr);
+
+    // periodically export progress metrics for monitoring
+    // MetricsExporter metrics(model, "dlaf.prom", n);
+
     // run diffusion-limited aggregation
-    for (int i = 0; i < 100000; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
         model.AddParticle();
     }
+    // or interleave several walkers, which pays off once the spatial index
+    // no longer fits in the last-level cache
+    // model.AddParticles(n);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    // report timing and allocation statistics
+    const Arena &arena = model.GetArena();
+    std::cerr
+        << n << " particles in " << elapsed.count() << "s, "
+        << arena.Allocations() << " index allocations, "
+        << arena.SystemAllocations() << " system allocations, "
+        << arena.BytesAllocated() / (1 << 20) << " MB" << std::endl;
+
+    // flush any buffered output
+    model.Flush();
+
+    // render the particles as spheres to a PPM image
+    // {
+    //     RenderOptions options;
+    //     options.Width = options.Height = 2048;
+    //     Render(model, options, "render.ppm");
+    // }
+
+    // export a closed triangle mesh around the particles
+    // {
+    //     MeshOptions options;
+    //     ExportMesh(model, options, "mesh.ply");
+    // }
+
+    // write tree topology metrics (depth, subtree size, branch order)
+    // std::ofstream topology("topology.csv");
+    // model.WriteTopology(topology);
 
     return 0;
 }
+#endif
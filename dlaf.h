@@ -0,0 +1,81 @@
+/* C API for dlaf. Build libdlaf.so and libdlaf.a with `make lib`.
+ *
+ * A dlaf_model is an opaque handle to a Model. Functions that can fail
+ * return a negative value (or NULL) instead of throwing, and particle arrays
+ * are copied into buffers owned by the caller. Positions have
+ * dlaf_dimensions() coordinates per particle. Static linking also needs
+ * -lstdc++ -lpthread. Only additions are made within one DLAF_API_VERSION.
+ */
+
+#ifndef DLAF_H
+#define DLAF_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DLAF_API_VERSION 1
+
+#if defined(__GNUC__)
+#define DLAF_API __attribute__((visibility("default")))
+#else
+#define DLAF_API
+#endif
+
+typedef struct dlaf_model dlaf_model;
+
+/* the API version the library was built with, and the number of
+ * coordinates per particle (2 or 3) */
+DLAF_API int dlaf_api_version(void);
+DLAF_API int dlaf_dimensions(void);
+
+/* creates a model with default parameters, or returns NULL */
+DLAF_API dlaf_model *dlaf_create(void);
+DLAF_API void dlaf_destroy(dlaf_model *model);
+
+/* parameters, as documented in the README */
+DLAF_API void dlaf_set_particle_spacing(dlaf_model *model, double a);
+DLAF_API void dlaf_set_attraction_distance(dlaf_model *model, double a);
+DLAF_API void dlaf_set_min_move_distance(dlaf_model *model, double a);
+DLAF_API void dlaf_set_stubbornness(dlaf_model *model, int a);
+DLAF_API void dlaf_set_stickiness(dlaf_model *model, double a);
+DLAF_API void dlaf_set_periodic_box(dlaf_model *model, double width);
+DLAF_API void dlaf_set_adaptive_launch(dlaf_model *model, int enabled);
+
+/* reseeds the random number generator of the calling thread */
+DLAF_API void dlaf_seed(unsigned int seed);
+
+/* reserves storage for the total number of particles. Returns 0 or -1. */
+DLAF_API int dlaf_reserve(dlaf_model *model, int particles);
+
+/* adds a particle (z is ignored in 2D) joined to parent, or -1 for a seed.
+ * Returns the id of the new particle or -1. */
+DLAF_API int dlaf_add(
+    dlaf_model *model, double x, double y, double z, int parent);
+
+/* grows n particles by random walks, interleaving the given number of
+ * walkers on the calling thread (1 for one at a time). Models are
+ * independent, so different models can grow on different threads at the
+ * same time. Returns 0, or -1 if there is no seed or on failure. */
+DLAF_API int dlaf_grow(dlaf_model *model, int n, int walkers);
+
+/* returns the number of particles */
+DLAF_API int dlaf_size(const dlaf_model *model);
+
+/* copy up to count particles starting at id start into the caller's
+ * buffer, which must hold count * dlaf_dimensions() doubles for positions
+ * and count values otherwise. Return the number of particles copied. */
+DLAF_API int dlaf_get_positions(
+    const dlaf_model *model, int start, int count, double *positions);
+DLAF_API int dlaf_get_parents(
+    const dlaf_model *model, int start, int count, int32_t *parents);
+DLAF_API int dlaf_get_join_attempts(
+    const dlaf_model *model, int start, int count, uint16_t *attempts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+// C API for dlaf (see dlaf.h). Every Model call that can throw is wrapped,
+// as exceptions must not cross the C boundary.
+
+#define DLAF_NO_MAIN
+#include "dlaf.cpp"
+#include "dlaf.h"
+
+struct dlaf_model {
+    Model model;
+};
+
+namespace {
+
+// Clamp limits a request for count particles from id start to the particles
+// that exist
+int Clamp(const dlaf_model *model, const int start, const int count) {
+    if (start < 0 || count <= 0) {
+        return 0;
+    }
+    return std::max(0, std::min(count, model->model.Size() - start));
+}
+
+}
+
+int dlaf_api_version(void) {
+    return DLAF_API_VERSION;
+}
+
+int dlaf_dimensions(void) {
+    return D;
+}
+
+dlaf_model *dlaf_create(void) {
+    try {
+        dlaf_model *model = new dlaf_model;
+        model->model.SetOutput(nullptr);
+        return model;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void dlaf_destroy(dlaf_model *model) {
+    delete model;
+}
+
+void dlaf_set_particle_spacing(dlaf_model *model, double a) {
+    model->model.SetParticleSpacing(a);
+}
+
+void dlaf_set_attraction_distance(dlaf_model *model, double a) {
+    model->model.SetAttractionDistance(a);
+}
+
+void dlaf_set_min_move_distance(dlaf_model *model, double a) {
+    model->model.SetMinMoveDistance(a);
+}
+
+void dlaf_set_stubbornness(dlaf_model *model, int a) {
+    model->model.SetStubbornness(a);
+}
+
+void dlaf_set_stickiness(dlaf_model *model, double a) {
+    model->model.SetStickiness(a);
+}
+
+void dlaf_set_periodic_box(dlaf_model *model, double width) {
+    model->model.SetPeriodicBox(width);
+}
+
+void dlaf_set_adaptive_launch(dlaf_model *model, int enabled) {
+    model->model.SetAdaptiveLaunch(enabled != 0);
+}
+
+void dlaf_seed(unsigned int seed) {
+    SeedRandom(seed);
+}
+
+int dlaf_reserve(dlaf_model *model, int particles) {
+    try {
+        model->model.Reserve(particles);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int dlaf_add(dlaf_model *model, double x, double y, double z, int parent) {
+    if (parent < -1 || parent >= model->model.Size()) {
+        return -1;
+    }
+    try {
+        model->model.Add(D == 2 ? Vector(x, y) : Vector(x, y, z), parent);
+        return model->model.Size() - 1;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int dlaf_grow(dlaf_model *model, int n, int walkers) {
+    if (model->model.Size() == 0) {
+        return -1;
+    }
+    try {
+        if (walkers > 1) {
+            model->model.AddParticles(n, walkers);
+        } else {
+            for (int i = 0; i < n; i++) {
+                model->model.AddParticle();
+            }
+        }
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int dlaf_size(const dlaf_model *model) {
+    return model->model.Size();
+}
+
+int dlaf_get_positions(
+    const dlaf_model *model, int start, int count, double *positions)
+{
+    count = Clamp(model, start, count);
+    for (int i = 0; i < count; i++) {
+        const Vector &p = model->model.Position(start + i);
+        const double v[] = {p.X(), p.Y(), p.Z()};
+        std::copy(v, v + D, positions + i * D);
+    }
+    return count;
+}
+
+int dlaf_get_parents(
+    const dlaf_model *model, int start, int count, int32_t *parents)
+{
+    count = Clamp(model, start, count);
+    if (count == 0) {
+        return 0;
+    }
+    const int *src = model->model.Parents() + start;
+    std::copy(src, src + count, parents);
+    return count;
+}
+
+int dlaf_get_join_attempts(
+    const dlaf_model *model, int start, int count, uint16_t *attempts)
+{
+    count = Clamp(model, start, count);
+    for (int i = 0; i < count; i++) {
+        attempts[i] = model->model.JoinAttempts(start + i);
+    }
+    return count;
+}
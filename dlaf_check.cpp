@@ -0,0 +1,242 @@
+// Checks run with `make check`.
+//
+// The walk in Model works with squared distances and skips square roots
+// wherever it can, so it no longer follows the same path as a direct
+// implementation for a given seed. This grows many clusters with both walks
+// and checks that their radius of gyration and fractal dimension have the
+// same distribution, failing if the means differ by more than the tolerance.
+// It also checks that the delta output format reads back what was written,
+// and that perf counters read with rdpmc agree with a group read.
+
+#define DLAF_NO_MAIN
+#include "dlaf.cpp"
+
+#include <sstream>
+
+namespace {
+
+// number of clusters grown with each walk and their size
+const int Runs = 100;
+const int Particles = 2000;
+
+// sizes at which the radius of gyration is sampled to fit the fractal
+// dimension
+const int Checkpoints[] = {250, 500, 1000, 2000};
+
+// the check fails if Welch's t statistic for either mean exceeds this
+const double MaxT = 4;
+
+// particles grown to compare the two ways of reading perf counters, and the
+// largest relative difference allowed between their instruction counts
+const int PerfParticles = 100000;
+const double PerfTolerance = 0.1;
+
+// AddParticleReference diffuses one new particle the direct way, with the
+// true distance to the nearest particle computed on every step and the
+// motion vector normalized separately
+void AddParticleReference(Model &model) {
+    const double attraction = DefaultAttractionDistance;
+    const double minMove = DefaultMinMoveDistance;
+    Vector p = model.RandomStartingPosition();
+    while (true) {
+        const int parent = model.Nearest(p);
+        const Vector &q = model.Position(parent);
+        const double d = p.Distance(q);
+        if (d < attraction) {
+            if (!model.ShouldJoin(p, parent)) {
+                p = Lerp(q, p, attraction + minMove);
+                continue;
+            }
+            const Vector placed = model.PlaceParticle(p, parent);
+            model.Add(placed, parent);
+            return;
+        }
+        const double m = std::max(minMove, d - attraction);
+        p += model.MotionVector(p).Normalized() * m;
+        if (p.Length() > model.BoundingRadius() * 2) {
+            p = model.RandomStartingPosition();
+        }
+    }
+}
+
+// RadiusOfGyration returns the radius of gyration of the first n particles,
+// which is the cluster as it was when it had n particles
+double RadiusOfGyration(const Model &model, const int n) {
+    Vector center;
+    for (int id = 0; id < n; id++) {
+        center += model.Position(id);
+    }
+    center = center * (1.0 / n);
+    double sum = 0;
+    for (int id = 0; id < n; id++) {
+        sum += (model.Position(id) - center).LengthSquared();
+    }
+    return std::sqrt(sum / n);
+}
+
+// Sample holds the radius of gyration and fractal dimension of every run
+struct Sample {
+    std::vector<double> RadiusOfGyration;
+    std::vector<double> FractalDimension;
+};
+
+// Grow grows Runs clusters with the specified walk and measures them. The
+// fractal dimension is the inverse slope of log Rg against log n.
+Sample Grow(
+    const unsigned int baseSeed, const std::function<void(Model &)> &add)
+{
+    Sample sample;
+    for (int run = 0; run < Runs; run++) {
+        SeedRandom(baseSeed + run);
+        Model model;
+        model.SetOutput(nullptr);
+        model.Reserve(Particles);
+        model.Add(Vector());
+        while (model.Size() < Particles) {
+            add(model);
+        }
+
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        const int k = sizeof(Checkpoints) / sizeof(Checkpoints[0]);
+        for (const int n : Checkpoints) {
+            const double x = std::log(RadiusOfGyration(model, n));
+            const double y = std::log(n);
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        const double slope = (k * sxy - sx * sy) / (k * sxx - sx * sx);
+        sample.RadiusOfGyration.push_back(
+            RadiusOfGyration(model, Particles));
+        sample.FractalDimension.push_back(slope);
+    }
+    return sample;
+}
+
+// WelchT returns Welch's t statistic for the difference of the means of a
+// and b, and stores the means
+double WelchT(
+    const std::vector<double> &a, const std::vector<double> &b,
+    double &meanA, double &meanB)
+{
+    const auto moments = [](const std::vector<double> &v, double &mean) {
+        mean = 0;
+        for (const double x : v) {
+            mean += x;
+        }
+        mean /= v.size();
+        double var = 0;
+        for (const double x : v) {
+            var += (x - mean) * (x - mean);
+        }
+        return var / (v.size() - 1) / v.size();
+    };
+    const double va = moments(a, meanA);
+    const double vb = moments(b, meanB);
+    return (meanA - meanB) / std::sqrt(va + vb);
+}
+
+// Compare reports one statistic and returns false if it is out of tolerance
+bool Compare(
+    const char *name,
+    const std::vector<double> &model, const std::vector<double> &reference)
+{
+    double meanModel, meanReference;
+    const double t = WelchT(model, reference, meanModel, meanReference);
+    const bool ok = std::abs(t) <= MaxT;
+    std::cout
+        << name << ": model " << meanModel << ", reference "
+        << meanReference << ", t = " << t << (ok ? "" : " FAILED")
+        << std::endl;
+    return ok;
+}
+
+// CheckDeltaRoundTrip attaches delta output after the seeds were added, as
+// the Python and C APIs do, and checks that reading it back gives every
+// particle with its parent and its position to within the precision
+bool CheckDeltaRoundTrip() {
+    const double precision = DefaultOutputPrecision;
+    SeedRandom(1);
+    Model model;
+    model.SetOutput(nullptr);
+    model.Add(Vector());
+    model.Add(Vector(5, 0, 0));
+    std::stringstream stream;
+    model.SetDeltaOutput(&stream, precision);
+    for (int i = 0; i < DeltaBlockSize + 100; i++) {
+        model.AddParticle();
+    }
+    model.Flush();
+
+    DeltaReader reader(stream);
+    int id, parent, count = 0;
+    Vector p;
+    bool ok = reader.Valid();
+    while (ok && reader.Next(id, parent, p)) {
+        ok = id == count && parent == model.Parent(id) &&
+            (p - model.Position(id)).Length() <= precision * D;
+        count++;
+    }
+    ok &= count == model.Size();
+    std::cout
+        << "delta round trip: " << count << " of " << model.Size()
+        << " particles" << (ok ? "" : " FAILED") << std::endl;
+    return ok;
+}
+
+// CheckPerfCounters grows the same cluster twice, reading the counters with
+// a system call and then with rdpmc, and checks that every phase takes the
+// same number of instructions per particle. It is skipped if the machine
+// has no PMU or the kernel does not allow rdpmc.
+bool CheckPerfCounters() {
+    const auto grow = [](PerfCounters &perf) {
+        SeedRandom(1);
+        Model model;
+        model.SetOutput(nullptr);
+        model.SetPerfCounters(&perf);
+        model.Add(Vector());
+        for (int i = 0; i < PerfParticles; i++) {
+            model.AddParticle();
+        }
+    };
+    PerfCounters group;
+    grow(group);
+    PerfCounters user(true);
+    grow(user);
+    if (group.Mean(0, PerfEventInstructions) < 0 || user.UserReads() == 0) {
+        std::cout << "perf counters: skipped, rdpmc unavailable" << std::endl;
+        return true;
+    }
+    bool ok = true;
+    for (int phase = 0; phase < PerfPhaseCount; phase++) {
+        const double a = group.Mean(phase, PerfEventInstructions);
+        const double b = user.Mean(phase, PerfEventInstructions);
+        const bool same = std::abs(a - b) <= PerfTolerance * a;
+        std::cout
+            << "perf counters, phase " << phase << ": read " << a
+            << ", rdpmc " << b << " instructions per particle"
+            << (same ? "" : " FAILED") << std::endl;
+        ok &= same;
+    }
+    return ok;
+}
+
+}
+
+int main() {
+    const Sample model = Grow(1, [](Model &m) {
+        m.AddParticle();
+    });
+    const Sample reference = Grow(1 + Runs, AddParticleReference);
+    bool ok = true;
+    ok &= Compare(
+        "radius of gyration",
+        model.RadiusOfGyration, reference.RadiusOfGyration);
+    ok &= Compare(
+        "fractal dimension",
+        model.FractalDimension, reference.FractalDimension);
+    ok &= CheckDeltaRoundTrip();
+    ok &= CheckPerfCounters();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,391 @@
+// Python bindings for dlaf. Build with `make python` and use from the
+// directory containing the extension:
+//
+//     import dlaf, numpy
+//     model = dlaf.Model()
+//     model.reserve(100001)
+//     model.add(0, 0)
+//     model.add_particles(100000)
+//     points = numpy.asarray(model.positions())
+//
+// positions(), parents() and join_attempts() return memoryviews of the
+// model's own storage, so no particles are copied. add_particles releases
+// the GIL, so several models can grow in parallel from Python threads.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define DLAF_NO_MAIN
+#include "dlaf.cpp"
+
+namespace {
+
+// PyModel is the Python object wrapping a Model
+struct PyModel {
+    PyObject_HEAD
+    Model *model;
+
+    // number of buffers currently exported from the model's storage, which
+    // must not move while there are any
+    Py_ssize_t exports;
+
+    // set while the model grows without the GIL, so that other threads
+    // cannot use it at the same time
+    bool busy;
+};
+
+// the kinds of arrays a PyView can expose
+enum ViewKind {
+    ViewPositions,
+    ViewParents,
+    ViewJoinAttempts
+};
+
+// PyView exports one array of a model through the buffer protocol. It keeps
+// the model alive and only looks up the storage when a buffer is requested.
+struct PyView {
+    PyObject_HEAD
+    PyModel *owner;
+    int kind;
+    Py_ssize_t count;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+};
+
+PyObject *ViewType;
+
+// Available checks that a model can be used from the calling thread
+bool Available(PyModel *self) {
+    if (self->busy) {
+        PyErr_SetString(
+            PyExc_RuntimeError, "model is growing in another thread");
+        return false;
+    }
+    return true;
+}
+
+// CanGrow checks that n more particles can be added without moving the
+// storage while buffers are exported
+bool CanGrow(PyModel *self, const Py_ssize_t n) {
+    const Model &model = *self->model;
+    if (self->exports > 0 && model.Size() + n > model.Capacity()) {
+        PyErr_SetString(
+            PyExc_BufferError,
+            "cannot grow beyond the reserved capacity while views exist");
+        return false;
+    }
+    return true;
+}
+
+PyObject *ModelNew(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    PyModel *self = (PyModel *)type->tp_alloc(type, 0);
+    if (!self) {
+        return nullptr;
+    }
+    self->model = new Model();
+    self->model->SetOutput(nullptr);
+    self->exports = 0;
+    self->busy = false;
+    return (PyObject *)self;
+}
+
+void ModelDealloc(PyModel *self) {
+    delete self->model;
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+// setters taking one number, e.g. set_attraction_distance(3)
+template <void (Model::*Set)(double)>
+PyObject *SetDouble(PyModel *self, PyObject *arg) {
+    const double a = PyFloat_AsDouble(arg);
+    if (PyErr_Occurred() || !Available(self)) {
+        return nullptr;
+    }
+    (self->model->*Set)(a);
+    Py_RETURN_NONE;
+}
+
+PyObject *SetStubbornness(PyModel *self, PyObject *arg) {
+    const long a = PyLong_AsLong(arg);
+    if (PyErr_Occurred() || !Available(self)) {
+        return nullptr;
+    }
+    self->model->SetStubbornness(a);
+    Py_RETURN_NONE;
+}
+
+PyObject *SetAdaptiveLaunch(PyModel *self, PyObject *arg) {
+    const int a = PyObject_IsTrue(arg);
+    if (a < 0 || !Available(self)) {
+        return nullptr;
+    }
+    self->model->SetAdaptiveLaunch(a);
+    Py_RETURN_NONE;
+}
+
+PyObject *Reserve(PyModel *self, PyObject *arg) {
+    const Py_ssize_t n = PyLong_AsSsize_t(arg);
+    if (PyErr_Occurred() || !Available(self) ||
+        !CanGrow(self, n - self->model->Size()))
+    {
+        return nullptr;
+    }
+    self->model->Reserve(n);
+    Py_RETURN_NONE;
+}
+
+PyObject *Add(PyModel *self, PyObject *args, PyObject *kwds) {
+    static const char *keywords[] = {"x", "y", "z", "parent", nullptr};
+    double x, y, z = 0;
+    int parent = -1;
+    if (!PyArg_ParseTupleAndKeywords(
+        args, kwds, "dd|di", (char **)keywords, &x, &y, &z, &parent))
+    {
+        return nullptr;
+    }
+    if (!Available(self) || !CanGrow(self, 1)) {
+        return nullptr;
+    }
+    if (parent < -1 || parent >= self->model->Size()) {
+        PyErr_SetString(PyExc_IndexError, "parent out of range");
+        return nullptr;
+    }
+    self->model->Add(Vector(x, y, z), parent);
+    return PyLong_FromLong(self->model->Size() - 1);
+}
+
+PyObject *AddParticles(PyModel *self, PyObject *args, PyObject *kwds) {
+    static const char *keywords[] = {"n", "walkers", nullptr};
+    int n, walkers = 1;
+    if (!PyArg_ParseTupleAndKeywords(
+        args, kwds, "i|i", (char **)keywords, &n, &walkers))
+    {
+        return nullptr;
+    }
+    if (!Available(self) || !CanGrow(self, n)) {
+        return nullptr;
+    }
+    if (self->model->Size() == 0) {
+        PyErr_SetString(PyExc_ValueError, "add a seed particle first");
+        return nullptr;
+    }
+    Model &model = *self->model;
+    self->busy = true;
+    Py_BEGIN_ALLOW_THREADS
+    if (walkers > 1) {
+        model.AddParticles(n, walkers);
+    } else {
+        for (int i = 0; i < n; i++) {
+            model.AddParticle();
+        }
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+    Py_RETURN_NONE;
+}
+
+PyObject *Seed(PyModel *self, PyObject *arg) {
+    const unsigned long seed = PyLong_AsUnsignedLong(arg);
+    if (PyErr_Occurred()) {
+        return nullptr;
+    }
+    SeedRandom(seed);
+    Py_RETURN_NONE;
+}
+
+Py_ssize_t Length(PyModel *self) {
+    return self->busy ? self->model->ParticleCount() : self->model->Size();
+}
+
+// MakeView returns a memoryview of one of the model's arrays
+PyObject *MakeView(PyModel *self, const int kind) {
+    if (!Available(self)) {
+        return nullptr;
+    }
+    PyView *view = PyObject_New(PyView, (PyTypeObject *)ViewType);
+    if (!view) {
+        return nullptr;
+    }
+    Py_INCREF(self);
+    view->owner = self;
+    view->kind = kind;
+    view->count = self->model->Size();
+    PyObject *result = PyMemoryView_FromObject((PyObject *)view);
+    Py_DECREF(view);
+    return result;
+}
+
+PyObject *Positions(PyModel *self, PyObject *) {
+    return MakeView(self, ViewPositions);
+}
+
+PyObject *Parents(PyModel *self, PyObject *) {
+    return MakeView(self, ViewParents);
+}
+
+PyObject *JoinAttempts(PyModel *self, PyObject *) {
+    return MakeView(self, ViewJoinAttempts);
+}
+
+int ViewGetBuffer(PyView *self, Py_buffer *view, int flags) {
+    PyModel *owner = self->owner;
+    if (owner->busy) {
+        PyErr_SetString(
+            PyExc_BufferError, "model is growing in another thread");
+        return -1;
+    }
+    Model &model = *owner->model;
+    void *buf;
+    Py_ssize_t itemsize;
+    const char *format;
+    int ndim = 1;
+    self->shape[0] = self->count;
+    switch (self->kind) {
+    case ViewPositions:
+        buf = (void *)model.Particles();
+        itemsize = sizeof(double);
+        format = "d";
+        ndim = 2;
+        self->shape[1] = D;
+        self->strides[0] = sizeof(Vector);
+        self->strides[1] = sizeof(double);
+        break;
+    case ViewParents:
+        buf = (void *)model.Parents();
+        itemsize = sizeof(int);
+        format = "i";
+        self->strides[0] = sizeof(int);
+        break;
+    default:
+        buf = (void *)model.JoinAttemptsStorage();
+        itemsize = sizeof(uint16_t);
+        format = "H";
+        self->strides[0] = sizeof(uint16_t);
+        break;
+    }
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "model views are read-only");
+        return -1;
+    }
+    if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES &&
+        self->strides[0] != itemsize)
+    {
+        PyErr_SetString(PyExc_BufferError, "model view is not contiguous");
+        return -1;
+    }
+    Py_INCREF(self);
+    view->obj = (PyObject *)self;
+    view->buf = buf;
+    view->len = self->count * (ndim == 2 ? D : 1) * itemsize;
+    view->readonly = 1;
+    view->itemsize = itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *)format : nullptr;
+    view->ndim = ndim;
+    view->shape = (flags & PyBUF_ND) ? self->shape : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) ? self->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    owner->exports++;
+    return 0;
+}
+
+void ViewReleaseBuffer(PyView *self, Py_buffer *view) {
+    self->owner->exports--;
+}
+
+void ViewDealloc(PyView *self) {
+    Py_DECREF(self->owner);
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_Free(self);
+    Py_DECREF(type);
+}
+
+PyMethodDef ModelMethods[] = {
+    {"set_particle_spacing",
+        (PyCFunction)SetDouble<&Model::SetParticleSpacing>, METH_O,
+        "Sets the distance between joined particles."},
+    {"set_attraction_distance",
+        (PyCFunction)SetDouble<&Model::SetAttractionDistance>, METH_O,
+        "Sets how close particles must be in order to join."},
+    {"set_min_move_distance",
+        (PyCFunction)SetDouble<&Model::SetMinMoveDistance>, METH_O,
+        "Sets the minimum distance a particle moves per step."},
+    {"set_stubbornness", (PyCFunction)SetStubbornness, METH_O,
+        "Sets the number of join attempts before a particle accepts another."},
+    {"set_stickiness", (PyCFunction)SetDouble<&Model::SetStickiness>, METH_O,
+        "Sets the probability that a particle accepts another."},
+    {"set_periodic_box", (PyCFunction)SetDouble<&Model::SetPeriodicBox>, METH_O,
+        "Grows upwards in a periodic box of the given width (0 disables)."},
+    {"set_adaptive_launch", (PyCFunction)SetAdaptiveLaunch, METH_O,
+        "Enables the adaptive launch sphere."},
+    {"reserve", (PyCFunction)Reserve, METH_O,
+        "Reserves storage for the given total number of particles."},
+    {"add", (PyCFunction)(void (*)())Add, METH_VARARGS | METH_KEYWORDS,
+        "add(x, y, z=0, parent=-1)\n--\n\nAdds a particle and returns its id."},
+    {"add_particles",
+        (PyCFunction)(void (*)())AddParticles, METH_VARARGS | METH_KEYWORDS,
+        "add_particles(n, walkers=1)\n--\n\n"
+        "Grows n particles by random walks, with the GIL released. With more\n"
+        "than one walker they are interleaved as in Model::AddParticles."},
+    {"seed", (PyCFunction)Seed, METH_O,
+        "Reseeds the random number generator of the calling thread."},
+    {"positions", (PyCFunction)Positions, METH_NOARGS,
+        "Returns a read-only (n, D) float64 view of the particle positions."},
+    {"parents", (PyCFunction)Parents, METH_NOARGS,
+        "Returns a read-only int32 view of the parent ids (-1 for seeds)."},
+    {"join_attempts", (PyCFunction)JoinAttempts, METH_NOARGS,
+        "Returns a read-only uint16 view of the join attempt counters."},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+PyType_Slot ModelSlots[] = {
+    {Py_tp_new, (void *)ModelNew},
+    {Py_tp_dealloc, (void *)ModelDealloc},
+    {Py_tp_methods, (void *)ModelMethods},
+    {Py_sq_length, (void *)Length},
+    {Py_tp_doc, (void *)"A diffusion-limited aggregation model."},
+    {0, nullptr}
+};
+
+PyType_Spec ModelSpec = {
+    "dlaf.Model", sizeof(PyModel), 0, Py_TPFLAGS_DEFAULT, ModelSlots
+};
+
+PyType_Slot ViewSlots[] = {
+    {Py_bf_getbuffer, (void *)ViewGetBuffer},
+    {Py_bf_releasebuffer, (void *)ViewReleaseBuffer},
+    {Py_tp_dealloc, (void *)ViewDealloc},
+    {0, nullptr}
+};
+
+PyType_Spec ViewSpec = {
+    "dlaf._View", sizeof(PyView), 0, Py_TPFLAGS_DEFAULT, ViewSlots
+};
+
+PyModuleDef ModuleDef = {
+    PyModuleDef_HEAD_INIT, "dlaf", "Diffusion-limited aggregation.", -1,
+    nullptr, nullptr, nullptr, nullptr, nullptr
+};
+
+}
+
+PyMODINIT_FUNC PyInit_dlaf() {
+    PyObject *module = PyModule_Create(&ModuleDef);
+    if (!module) {
+        return nullptr;
+    }
+    PyObject *model = PyType_FromSpec(&ModelSpec);
+    ViewType = PyType_FromSpec(&ViewSpec);
+    if (!model || !ViewType ||
+        PyModule_AddObject(module, "Model", model) < 0)
+    {
+        Py_XDECREF(model);
+        Py_CLEAR(ViewType);
+        Py_DECREF(module);
+        return nullptr;
+    }
+    PyModule_AddIntConstant(module, "D", D);
+    return module;
+}